@@ -78,6 +78,14 @@ public:
     return alignments[0]->getQUAL(qi, mate);
   }
 
+  /*
+    @param   name   new read name
+    @comment: rename all alignments, call after the group is written with choice 2 so that no alignment is compressed
+   */
+  void setName(const char* name) {
+    for (int i = 0; i < s; ++i) alignments[i]->setName(name);
+  }
+
   BamAlignment* getAlignment(int id) { 
     assert(id >=0 && id < s);
     return alignments[id];
@@ -72,3 +72,24 @@ bool BamAlignment::write(samFile* out, const bam_hdr_t* header, int choice, BamA
 
   return true;
 }
+
+uint64_t BamAlignment::hash(uint64_t h, bool with_seq) const {
+  assert(is_aligned >= 0);
+  h = hash_bam(h, b, with_seq);
+  if (is_paired) h = hash_bam(h, b2, with_seq);
+  return h;
+}
+
+uint64_t BamAlignment::hash_bam(uint64_t h, const bam1_t* b, bool with_seq) {
+  const bam1_core_t &c = b->core;
+  int32_t fields[8] = {c.tid, c.pos, (int32_t)c.flag, (int32_t)c.n_cigar, c.l_qseq, c.mtid, c.mpos, c.isize};
+
+  h = fnv1a(h, fields, sizeof(fields));
+  h = fnv1a(h, bam_get_cigar(b), c.n_cigar * 4);
+  if (with_seq) {
+    h = fnv1a(h, bam_get_seq(b), (c.l_qseq + 1) / 2);
+    h = fnv1a(h, bam_get_qual(b), c.l_qseq);
+  }
+
+  return h;
+}
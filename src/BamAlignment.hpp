@@ -3,6 +3,7 @@
 
 #include<cmath>
 #include<cassert>
+#include<cstring>
 #include<string>
 #include<algorithm>
 
@@ -47,6 +48,23 @@ public:
     @param   o        optional BAM alignment
    */
   bool write(samFile* out, const bam_hdr_t* header, int choice = 0, BamAlignment* o = NULL);
+
+  /*
+    @param   h          a running 64-bit FNV-1a hash
+    @param   with_seq   if the read sequence and quality scores are hashed as well
+    @return  h updated with the flag, position, CIGAR and mate information of both mates
+    @comment: used to detect duplicate reads, secondary alignments do not carry their own sequence and quality scores
+   */
+  uint64_t hash(uint64_t h, bool with_seq) const;
+
+  /*
+    @param   name   new read name
+    @comment: rename both mates, the alignment must not be compressed
+   */
+  void setName(const char* name) {
+    set_qname(b, name);
+    if (is_paired) set_qname(b2, name);
+  }
   
   // overall stats
   
@@ -306,6 +324,24 @@ protected:
     }
   }
 
+  void set_qname(bam1_t* b, const char* name) {
+    int l_qname = strlen(name) + 1, l_rest = b->l_data - b->core.l_qname;
+    assert(b->core.l_qname > 1 && l_qname <= 255);
+    b->l_data = l_qname + l_rest;
+    expand_data_size(b);
+    memmove(b->data + l_qname, b->data + b->core.l_qname, l_rest);
+    memcpy(b->data, name, l_qname);
+    b->core.l_qname = l_qname;
+  }
+
+  static uint64_t fnv1a(uint64_t h, const void* data, size_t n) {
+    const uint8_t *p = (const uint8_t*)data;
+    for (size_t i = 0; i < n; ++i) { h ^= p[i]; h *= 1099511628211ULL; }
+    return h;
+  }
+
+  static uint64_t hash_bam(uint64_t h, const bam1_t* b, bool with_seq);
+
   void copy_rc_seq(uint8_t* dst, uint8_t* src, int len) {
     uint8_t base;
     for (int i = 0; i < len; ++i) {
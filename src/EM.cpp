@@ -5,6 +5,7 @@
 #include<cstdlib>
 #include<cassert>
 #include<vector>
+#include<algorithm>
 #include<string>
 #include<iostream>
 #include<pthread.h>
@@ -33,6 +34,7 @@ bool verbose = true; // define verbose
 
 const int MAX_ROUND = 1000; // default maximum iterations
 const double deltaChange = 5e-6; // default log probability change per read
+const int MAX_READ_MODEL_ROUND = 10; // default number of rounds updating the read model
 
 // Parameter struct to pass parameters to each subprocess
 struct InMemParams {
@@ -46,6 +48,10 @@ struct InMemParams {
 
   double count0; // sum of noise read fractions
   double loglik; // log likelihood
+  HIT_INT_TYPE ndropped; // number of alignments dropped by the last pruning
+
+  bool has_sample; // if the read model is trained on a sample of reads, whose alignment groups are copied to imdName_channel_no.sample.bam
+  double sample_weight; // number of reads each sampled read stands for
 
   InMemParams(int no, PROBerWholeModel* whole_model, PROBerReadModel* read_model, READ_INT_TYPE nreads, HIT_INT_TYPE nlines) {
     this->no = no;
@@ -54,6 +60,9 @@ struct InMemParams {
     estimator = NULL;
     chunk = new InMemChunk(nreads, nlines);
     count0 = loglik = 0.0;
+    ndropped = 0;
+    has_sample = false;
+    sample_weight = 1.0;
   }
 
   ~InMemParams() {
@@ -89,12 +98,58 @@ pthread_attr_t attr;
 int rc;
 
 bool output_bam, output_logMAP;
+bool binary_params; // write gamma, beta and theta into a binary parameter store
+bool fuse_counts; // accumulate counts during the E step
+
+double read_model_tol; // stop updating read models once no probability changes more than this in a round, negative means updating for a fixed number of rounds
+int read_model_min_rounds, read_model_max_rounds; // update read models for at least/most this many rounds
+bool read_model_converged; // if the last update changed read models by less than read_model_tol
+
+int prune_every; // prune negligible alignments every prune_every rounds, 0 means never
+double prune_threshold; // alignments whose expected weight is below prune_threshold are pruned
+bool prune_now; // if the current E step prunes
+bool pruned; // if alignments have been pruned, after which they no longer match the BAM files one by one
+
+int loglik_every; // calculate the log probability every loglik_every rounds and in the last round, 0 means only in the last round
+bool calc_loglik; // if the current round calculates the log probability
+double param_tol; // stop once no theta changes relatively and no gamma/beta changes absolutely more than param_tol in a round, negative means using the log probability criterion
+bool convergence_trace; // write statName.convergence with one line per round
+
+READ_INT_TYPE read_model_sample; // train read models on this many alignable reads per channel, 0 means all reads
+bool sample_pass; // if the current E step only parses the sampled reads, i.e. the read model is updated but conditional probabilities of the other reads are kept
+
+char warmSampleName[STRLEN], warmStatName[STRLEN]; // a previous run to warm start from
+bool warm_start, warm_read_model; // if warm start the transcript models, if also warm start the read models
+
+char fixedStatName[STRLEN]; // a previous run whose read models are used as fixed input
+bool fixed_read_model; // if read models are fixed, conditional probabilities are then calculated once while preprocessing and BAM files are never parsed during EM
 
 bam_hdr_t *hdr;
 
+/*
+  @param   dupF    a .dup file written by PROBer-parse-alignments --collapse-duplicates, one "read_index\tname" line per collapsed copy
+  @param   chunk   the chunk holding the partition's reads
+  @return  number of collapsed copies, 0 if dupF does not exist
+ */
+READ_INT_TYPE loadDuplicates(const char* dupF, InMemChunk* chunk) {
+  ifstream fin(dupF);
+  if (!fin.is_open()) return 0;
+
+  READ_INT_TYPE rid, ndups = 0;
+  string name;
+  while (fin>> rid>> name) {
+    assert(rid < chunk->nreads);
+    ++chunk->reads[rid + 1].mult;
+    ++ndups;
+  }
+  fin.close();
+
+  return ndups;
+}
+
 // Preprocess reads and alignments
 void preprocessAlignments(int channel) {
-  char bamF[STRLEN], partitionF[STRLEN];
+  char bamF[STRLEN], partitionF[STRLEN], dupF[STRLEN];
   SamParser *parser = NULL;
   AlignmentGroup ag;
 
@@ -130,14 +185,43 @@ void preprocessAlignments(int channel) {
 
   bool is_paired;
   int seqlen;
+  READ_INT_TYPE ndups = 0;
+
+  vector<READ_INT_TYPE> nreadsVec(num_threads);
+  vector<HIT_INT_TYPE> nlinesVec(num_threads);
+  READ_INT_TYPE total = 0;
+
+  for (int i = 0; i < num_threads; ++i) {
+    fin>> id>> nreadsVec[i]>> nlinesVec[i];
+    assert(id == i);
+    total += nreadsVec[i];
+  }
+  fin.close();
+
+  // Draw exactly read_model_sample reads by selection sampling with a fixed seed, so that reruns train on the same reads
+  bool use_sample = !fixed_read_model && read_model_sample > 0 && read_model_sample < total;
+  Sampler *sampler = use_sample ? new Sampler(1) : NULL;
+  BamWriter *sample_writer = NULL;
+  READ_INT_TYPE seen = 0, nsampled = 0;
 
   N_eff[channel] = N0[channel];
   paramsVecs[channel].assign(num_threads, NULL);
   for (int i = 0; i < num_threads; ++i) {
-    fin>> id>> nreads>> nlines;
-    assert(id == i);
+    nreads = nreadsVec[i];
+    nlines = nlinesVec[i];
     N_eff[channel] += nreads;
     paramsVecs[channel][i] = new InMemParams(i, whole_model, read_models[channel], nreads, nlines);
+    if (use_sample) {
+      paramsVecs[channel][i]->has_sample = true;
+      paramsVecs[channel][i]->sample_weight = double(total) / read_model_sample;
+      sprintf(bamF, "%s_%s_%d.sample.bam", imdName, channelStr[channel], i);
+      sample_writer = new BamWriter(bamF, hdr);
+    }
+
+    sprintf(dupF, "%s_%s_%d.dup", imdName, channelStr[channel], i);
+    READ_INT_TYPE n = loadDuplicates(dupF, paramsVecs[channel][i]->chunk);
+    N_eff[channel] += n;
+    ndups += n;
 
     sprintf(bamF, "%s_%s_%d.bam", imdName, channelStr[channel], i);
     parser = new SamParser(bamF, hdr);
@@ -159,10 +243,18 @@ void preprocessAlignments(int channel) {
         else if (seqlen < read_length) aligns[j].fragment_length = ba->getAlignedLength();
         else aligns[j].fragment_length = 0;
 
-        aligns[j].frac = 1.0 / ag.size();
+        aligns[j].idx = j;
+        aligns[j].frac = double(a_read->mult) / ag.size();
       }
       whole_model->addAlignments(a_read, aligns);
-      read_models[channel]->update_preprocess(ag, true);
+      read_models[channel]->update_preprocess(ag, true, a_read->mult);
+      read_models[channel]->setComposition(a_read, ag);
+      if (fixed_read_model) read_models[channel]->setConProbs(a_read, aligns, ag);
+      if (use_sample) {
+	a_read->sampled = (total - seen) * sampler->random() < read_model_sample - nsampled;
+	if (a_read->sampled) { sample_writer->write(ag); ++nsampled; }
+	++seen;
+      }
       ++rid;
 
       if (verbose && (rid % 1000000 == 0)) cout<< "Loaded "<< rid<< " reads!"<< endl;
@@ -170,6 +262,7 @@ void preprocessAlignments(int channel) {
     assert(rid == nreads);
 
     delete parser;
+    if (sample_writer != NULL) { delete sample_writer; sample_writer = NULL; }
     if (verbose) { printf("Thread %d's data is preprocessed!\n", i); }
 
     chunk = paramsVecs[channel][i]->chunk;
@@ -178,10 +271,24 @@ void preprocessAlignments(int channel) {
   }
 
   if (verbose) { printf("There are %d alignments filtered!\n", cnt); }
+  if (verbose && ndups > 0) { printf("%llu duplicate reads are collapsed!\n", (unsigned long long)ndups); }
+  if (use_sample) {
+    assert(nsampled == read_model_sample);
+    delete sampler;
+    if (verbose) { printf("Read model for channel %s is trained on %llu of %llu alignable reads!\n", channelStr[channel], (unsigned long long)nsampled, (unsigned long long)total); }
+  }
 
-  for (int i = 0; i < num_threads; ++i) 
-    paramsVecs[channel][i]->estimator = new PROBerReadModel(read_models[channel]);
+  if (!fixed_read_model)
+    for (int i = 0; i < num_threads; ++i) 
+      paramsVecs[channel][i]->estimator = new PROBerReadModel(read_models[channel]);
   read_models[channel]->finish_preprocess();
+
+  if (warm_read_model) {
+    char readModelF[STRLEN];
+    sprintf(readModelF, "%s_%s.read_model", warmStatName, channelStr[channel]);
+    read_models[channel]->warmStart(readModelF);
+    if (verbose) { printf("Read model for channel %s is warm started from %s!\n", channelStr[channel], readModelF); }
+  }
   
   if (verbose) { printf("Bam preprocessing is done for channel %s!\n", channelStr[channel]); }
 
@@ -207,11 +314,23 @@ void init() {
   // Create PROBerWholeModel
   sprintf(configF, "%s.config", imdName);
   whole_model = new PROBerWholeModel(configF, (has_control ? 2 : 0), has_control, &transcripts, num_threads, read_length, isMAP);
+  if (warm_start) whole_model->setWarmStart(warmSampleName, warmStatName);
+  if (fuse_counts) whole_model->enableFusedCounts();
+  if (param_tol >= 0.0 || convergence_trace) whole_model->enableChangeTracking();
 
   // Create PROBerReadModels
   read_models[0] = has_control ? new PROBerReadModel(model_type, &refs, read_length) : NULL;
   read_models[1] = new PROBerReadModel(model_type, &refs, read_length);
 
+  if (fixed_read_model) {
+    char readModelF[STRLEN];
+    for (int channel = (has_control ? 0 : 1); channel < 2; ++channel) {
+      sprintf(readModelF, "%s_%s.read_model", fixedStatName, channelStr[channel]);
+      read_models[channel]->loadFixed(readModelF);
+      if (verbose) { printf("Read model for channel %s is fixed to %s!\n", channelStr[channel], readModelF); }
+    }
+  }
+
   memset(N0, 0, sizeof(N0));
   memset(N_eff, 0, sizeof(N_eff));
 
@@ -245,45 +364,69 @@ void* E_STEP(void* arg) {
   params->count0 = 0.0;
   params->loglik = 0.0;
 
+  // prune by the weights of the last E step, which are already counted
+  if (prune_now) params->ndropped = chunk->prune(prune_threshold);
   chunk->reset();
 
+  // while the read model is trained on a sample, only the sampled reads are parsed and the others keep their conditional probabilities
+  bool sample_only = sample_pass && params->has_sample;
   if (needCalcConPrb || updateReadModel) {
+    assert(!pruned);
     char bamF[STRLEN];
-    sprintf(bamF, "%s_%s_%d.bam", imdName, whole_model->get_channel_string(whole_model->getChannel()), params->no);
+    sprintf(bamF, (sample_only ? "%s_%s_%d.sample.bam" : "%s_%s_%d.bam"), imdName, whole_model->get_channel_string(whole_model->getChannel()), params->no);
     parser = new SamParser(bamF, hdr); 
   }
   if (updateReadModel) estimator->init();
+  if (fuse_counts) whole_model->resetCounts(params->no);
 
   READ_INT_TYPE nreads = chunk->nreads;
   int size;
+  double prob_noise = whole_model->getProb(0);
   double sum, noise_frac;
   InMemAlignG *a_read = NULL;
   InMemAlign *aligns = NULL;
+  int mult;
+  bool parsed; // if ag holds the current read
+
+  // Without BAM parsing, weigh all alignments in one flat pass that does not depend on how many alignments each read has
+  if (parser == NULL) 
+    for (InMemAlign *align = chunk->aligns, *end = chunk->aligns + chunk->nlines; align != end; ++align)
+      align->frac = (align->conprb > 0.0 ? whole_model->getProb(align->tid, align->pos, align->fragment_length) * align->conprb : 0.0);
 
   for (READ_INT_TYPE i = 0; i < nreads; ++i) {
-    if (needCalcConPrb || updateReadModel) {
+    assert(chunk->next(a_read, aligns));
+
+    parsed = parser != NULL && (!sample_only || a_read->sampled);
+    if (parsed) {
       assert(parser->next(ag));
     }
 
-    assert(chunk->next(a_read, aligns));
-
-    if (needCalcConPrb) read_model->setConProbs(a_read, aligns, ag);
+    if (needCalcConPrb && parsed) read_model->setConProbs(a_read, aligns, ag);
 
     size = a_read->size;
-    sum = noise_frac = whole_model->getProb(0) * a_read->noise_conprb;
-    for (int j = 0; j < size; ++j) {
-      if (aligns[j].conprb > 0.0) aligns[j].frac = whole_model->getProb(aligns[j].tid, aligns[j].pos, aligns[j].fragment_length) * aligns[j].conprb;
-      else aligns[j].frac = 0.0;
-      sum += aligns[j].frac;
-    }
+    mult = a_read->mult;
+    sum = noise_frac = prob_noise * a_read->noise_conprb;
+    if (parser != NULL) 
+      for (int j = 0; j < size; ++j) {
+	if (aligns[j].conprb > 0.0) aligns[j].frac = whole_model->getProb(aligns[j].tid, aligns[j].pos, aligns[j].fragment_length) * aligns[j].conprb;
+	else aligns[j].frac = 0.0;
+	sum += aligns[j].frac;
+      }
+    else if (size == 1) sum += aligns[0].frac; // unique reads, the majority
+    else 
+      for (int j = 0; j < size; ++j) sum += aligns[j].frac;
     assert(sum > 0.0);
 
-    params->loglik += log(sum);
-    noise_frac /= sum;
+    // a collapsed read counts once per copy
+    if (calc_loglik) params->loglik += mult * log(sum);
+    noise_frac = noise_frac / sum * mult;
     params->count0 += noise_frac;
-    for (int j = 0; j < size; ++j) aligns[j].frac /= sum;
+    if (size == 1) aligns[0].frac = aligns[0].frac / sum * mult;
+    else 
+      for (int j = 0; j < size; ++j) aligns[j].frac = aligns[j].frac / sum * mult;
+    if (fuse_counts) whole_model->addCounts(params->no, a_read, aligns);
 
-    if (updateReadModel) estimator->update(a_read, aligns, ag, noise_frac);    
+    if (updateReadModel && a_read->sampled) estimator->update(a_read, aligns, ag, noise_frac, params->sample_weight);
   }
 
   if (parser != NULL) delete parser;
@@ -292,14 +435,18 @@ void* E_STEP(void* arg) {
 }
 
 inline bool needUpdateReadModel(int ROUND) {
-  return ROUND <= 10;
+  if (fixed_read_model || ROUND > read_model_max_rounds) return false;
+  return read_model_tol < 0.0 || ROUND <= read_model_min_rounds || !read_model_converged;
 }
 
 void one_EM_iteration(int channel, int ROUND) {
   // init
   if (ROUND == 1) whole_model->init();
 
-  logprob[channel] = (isMAP ? whole_model->getLogPrior() : 0.0);
+  logprob[channel] = (isMAP && calc_loglik ? whole_model->getLogPrior() : 0.0);
+
+  // Pruning changes which alignment of a read an InMemAlign is, so only prune once BAM files are no longer parsed
+  prune_now = prune_every > 0 && !needCalcConPrb && !updateReadModel && ROUND % prune_every == 0;
 
   // E step
   for (int i = 0; i < num_threads; ++i) {
@@ -312,9 +459,23 @@ void one_EM_iteration(int channel, int ROUND) {
     pthread_assert(rc, "pthread_join", "Cannot join thread " + itos(i) + " (numbered from 0) at EM ROUND " + itos(ROUND) + " for " + channelStr[channel] + " channel!");
   }
 
+  if (prune_now) {
+    HIT_INT_TYPE ndropped = 0;
+    vector<InMemChunk*> chunks;
+    for (int i = 0; i < num_threads; ++i) {
+      ndropped += paramsVecs[channel][i]->ndropped;
+      chunks.push_back(paramsVecs[channel][i]->chunk);
+    }
+    whole_model->reindexAlignments(channel, chunks);
+    pruned = true;
+    if (verbose) printf("Pruned %llu alignments at ROUND %d for %s channel!\n", (unsigned long long)ndropped, ROUND - 1, channelStr[channel]);
+  }
+
   count0[channel] = N0[channel];
-  if (N0[channel] > 0) logprob[channel] += N0[channel] * log(whole_model->getTheta(0));
-  logprob[channel] += read_models[channel]->calcLogP();
+  if (calc_loglik) {
+    if (N0[channel] > 0) logprob[channel] += N0[channel] * log(whole_model->getTheta(0));
+    logprob[channel] += read_models[channel]->calcLogP();
+  }
   for (int i = 0; i < num_threads; ++i) {
     count0[channel] += paramsVecs[channel][i]->count0;
     logprob[channel] += paramsVecs[channel][i]->loglik;
@@ -336,38 +497,90 @@ void one_EM_iteration(int channel, int ROUND) {
 
 void EM() {
   int ROUND;
-  double prev_logprob, curr_logprob;
+  double prev_logprob, curr_logprob, delta;
+  int prev_round, curr_round; // rounds in which prev_logprob and curr_logprob were calculated
+  double theta_change, gamma_beta_change; // largest changes over both channels in the last round
+  FILE *ftrace = NULL;
 
   ROUND = 0;
-  needCalcConPrb = updateReadModel = true;
+  needCalcConPrb = updateReadModel = !fixed_read_model; // conditional probabilities of a fixed read model are calculated while preprocessing
   prev_logprob = curr_logprob = -1e300;
+  prev_round = curr_round = 0;
+  delta = 0.0;
+  theta_change = gamma_beta_change = 1e300;
   keepGoing = true;
 
+  if (convergence_trace) {
+    char traceF[STRLEN];
+    sprintf(traceF, "%s.convergence", statName);
+    ftrace = fopen(traceF, "w");
+    general_assert(ftrace != NULL, "Cannot create " + cstrtos(traceF) + "!");
+    fprintf(ftrace, "#round\tlog_probability\tdelta_change\ttheta_change\tgamma_beta_change\n");
+  }
+
   do {
     ++ROUND;
 
     needCalcConPrb = updateReadModel;
     updateReadModel = needUpdateReadModel(ROUND);
+    // the first round computes conditional probabilities for all reads, the round after the last update recomputes them with the final read model
+    sample_pass = needCalcConPrb && updateReadModel && ROUND > 1;
+
+    // the log probability criterion compares the per round change since the previous calculation, and waits if the last round did not calculate it
+    if (param_tol >= 0.0) 
+      keepGoing = (ROUND <= MAX_ROUND) && (ROUND <= 2 || max(theta_change, gamma_beta_change) >= param_tol);
+    else
+      keepGoing = (ROUND <= MAX_ROUND) && (ROUND <= 2 || curr_round < ROUND - 1 || delta > deltaChange);
+    calc_loglik = !keepGoing || (loglik_every > 0 && (ROUND - 1) % loglik_every == 0);
 
-    keepGoing = (ROUND <= MAX_ROUND) && (ROUND <= 2 || (curr_logprob - prev_logprob) / (N_eff[0] + N_eff[1]) > deltaChange);
+    theta_change = gamma_beta_change = 0.0;
 
     // (-) channel
     if (has_control) {
       one_EM_iteration(0, ROUND);
       whole_model->flipState();
+      theta_change = whole_model->getThetaChange();
+      gamma_beta_change = whole_model->getGammaBetaChange();
     }
     
     // (+) channel
     one_EM_iteration(1, ROUND);
     if (has_control) whole_model->flipState();
+    theta_change = max(theta_change, whole_model->getThetaChange());
+    gamma_beta_change = max(gamma_beta_change, whole_model->getGammaBetaChange());
+
+    if (updateReadModel && keepGoing && read_model_tol >= 0.0) {
+      double change = read_models[1]->getParamChange();
+      if (has_control) change = max(change, read_models[0]->getParamChange());
+      read_model_converged = change < read_model_tol;
+      if (verbose && read_model_converged && ROUND >= read_model_min_rounds && ROUND < read_model_max_rounds) printf("Read models converged at ROUND %d, largest change = %.3g!\n", ROUND - 1, change);
+    }
 
-    prev_logprob = curr_logprob;
-    curr_logprob = logprob[0] + logprob[1];
+    if (calc_loglik) {
+      prev_logprob = curr_logprob; prev_round = curr_round;
+      curr_logprob = logprob[0] + logprob[1]; curr_round = ROUND;
+      delta = (curr_logprob - prev_logprob) / (curr_round - prev_round) / (N_eff[0] + N_eff[1]);
 
-    if (verbose) printf("Log probability of ROUND %d = %.2f, delta Change = %.10g\n", ROUND - 1, curr_logprob, (curr_logprob - prev_logprob) / (N_eff[0] + N_eff[1]));
+      if (verbose) printf("Log probability of ROUND %d = %.2f, delta Change = %.10g\n", ROUND - 1, curr_logprob, delta);
+    }
+    if (verbose && keepGoing && param_tol >= 0.0) printf("Parameter changes of ROUND %d: theta = %.3g, gamma/beta = %.3g\n", ROUND, theta_change, gamma_beta_change);
+
+    if (ftrace != NULL) {
+      fprintf(ftrace, "%d", ROUND);
+      if (calc_loglik) {
+	fprintf(ftrace, "\t%.2f", curr_logprob);
+	if (prev_round > 0) fprintf(ftrace, "\t%.10g", delta);
+	else fprintf(ftrace, "\tNA");
+      }
+      else fprintf(ftrace, "\tNA\tNA");
+      if (keepGoing) fprintf(ftrace, "\t%.6g\t%.6g\n", theta_change, gamma_beta_change);
+      else fprintf(ftrace, "\tNA\tNA\n");
+    }
 
   } while (keepGoing);
 
+  if (ftrace != NULL) fclose(ftrace);
+
   if (output_logMAP) {
     char logMAPF[STRLEN];
     sprintf(logMAPF, "%s.logMAP", sampleName);
@@ -379,8 +592,12 @@ void EM() {
   if (verbose) printf("EM is finished!\n");
 }
 
+bool compareDupIndex(const pair<READ_INT_TYPE, string>& a, const pair<READ_INT_TYPE, string>& b) {
+  return a.first < b.first;
+}
+
 void outputBamFiles(int channel) {
-  char inp0F[STRLEN], inpF[STRLEN], inp2F[STRLEN], outF[STRLEN];
+  char inp0F[STRLEN], inpF[STRLEN], inp2F[STRLEN], outF[STRLEN], dupF[STRLEN];
 
   sprintf(outF, "%s_%s.bam", sampleName, channelStr[channel]);
   BamWriter* writer = new BamWriter(outF, hdr, "PROBer");
@@ -394,6 +611,19 @@ void outputBamFiles(int channel) {
     READ_INT_TYPE nreads = chunk->nreads;
     InMemAlignG *a_read = NULL;
     InMemAlign *aligns = NULL;
+
+    // collapsed copies are written right after their representative, under their own names
+    vector<pair<READ_INT_TYPE, string> > dups;
+    READ_INT_TYPE rid;
+    string name;
+    size_t next_dup = 0;
+    sprintf(dupF, "%s_%s_%d.dup", imdName, channelStr[channel], i);
+    ifstream fdup(dupF);
+    if (fdup.is_open()) {
+      while (fdup>> rid>> name) dups.push_back(make_pair(rid, name));
+      fdup.close();
+      stable_sort(dups.begin(), dups.end(), compareDupIndex);
+    }
     
     ag.clear();
     chunk->reset();
@@ -401,14 +631,23 @@ void outputBamFiles(int channel) {
       assert(parser->next(ag));
       assert(chunk->next(a_read, aligns));
       
+      // pruned alignments are reported with zero weight
       int size = a_read->size;
+      if (pruned) 
+        for (int k = 0; k < ag.size(); ++k) ag.getAlignment(k)->setFrac(0.0);
       for (int k = 0; k < size; ++k) 
-        ag.getAlignment(k)->setFrac(aligns[k].frac);
+        ag.getAlignment(aligns[k].idx)->setFrac(aligns[k].frac / a_read->mult);
       writer->write(ag, 2);
+
+      for (; next_dup < dups.size() && dups[next_dup].first == j; ++next_dup) {
+	ag.setName(dups[next_dup].second.c_str());
+	writer->write(ag, 2);
+      }
       
-      ++cnt;
-      if (verbose && (cnt % 1000000 == 0)) cout<< "Processed "<< cnt<< " reads!"<< endl;
+      cnt += a_read->mult;
+      if (verbose && (cnt % 1000000 < (READ_INT_TYPE)a_read->mult)) cout<< "Processed "<< cnt<< " reads!"<< endl;
     }
+    assert(next_dup == dups.size());
     delete parser;
   }
   
@@ -448,7 +687,7 @@ void writeResults() {
 
   
   // output whole model parameters
-  whole_model->write(sampleName, statName);
+  whole_model->write(sampleName, statName, binary_params);
 
   // output BAM files
   if (output_bam) {
@@ -486,7 +725,7 @@ void release() {
 
 int main(int argc, char* argv[]) {
   if (argc < 7) {
-    printf("Usage: PROBer-run-em refName model_type sampleName imdName statName num_of_threads [--read-length read_length] [--maximum-likelihood] [--output-bam] [--output-logMAP] [--no-control] [-q]\n");
+    printf("Usage: PROBer-run-em refName model_type sampleName imdName statName num_of_threads [--read-length read_length] [--maximum-likelihood] [--output-bam] [--output-logMAP] [--binary-params] [--fuse-counts] [--read-model-tolerance tol] [--read-model-min-rounds min_rounds] [--read-model-max-rounds max_rounds] [--read-model-sample N] [--prune-every K] [--prune-threshold threshold] [--no-control] [--warm-start prev_sampleName prev_statName] [--warm-start-read-model] [--fixed-read-model prev_statName] [--loglik-every K] [--param-tolerance tol] [--convergence-trace] [-q]\n");
     exit(-1);
   }
 
@@ -499,18 +738,63 @@ int main(int argc, char* argv[]) {
 
   output_bam = false;
   output_logMAP = false;
+  binary_params = false;
+  fuse_counts = false;
+  read_model_tol = -1.0;
+  read_model_min_rounds = 1;
+  read_model_max_rounds = MAX_READ_MODEL_ROUND;
+  read_model_converged = false;
+  read_model_sample = 0;
+  sample_pass = false;
+  prune_every = 0;
+  prune_threshold = 1e-6;
+  prune_now = pruned = false;
   read_length = -1;
   isMAP = true;
   has_control = true;
+  warm_start = warm_read_model = false;
+  fixed_read_model = false;
+  loglik_every = 1;
+  calc_loglik = true;
+  param_tol = -1.0;
+  convergence_trace = false;
   for (int i = 7; i < argc; ++i) {
     if (!strcmp(argv[i], "--read-length")) read_length = atoi(argv[i + 1]);
     if (!strcmp(argv[i], "--maximum-likelihood")) isMAP = false;
     if (!strcmp(argv[i], "--output-bam")) output_bam = true;
     if (!strcmp(argv[i], "--output-logMAP")) output_logMAP = true;
+    if (!strcmp(argv[i], "--binary-params")) binary_params = true;
+    if (!strcmp(argv[i], "--fuse-counts")) fuse_counts = true;
+    if (!strcmp(argv[i], "--read-model-tolerance")) read_model_tol = atof(argv[i + 1]);
+    if (!strcmp(argv[i], "--read-model-min-rounds")) read_model_min_rounds = atoi(argv[i + 1]);
+    if (!strcmp(argv[i], "--read-model-max-rounds")) read_model_max_rounds = atoi(argv[i + 1]);
+    if (!strcmp(argv[i], "--read-model-sample")) read_model_sample = strtoull(argv[i + 1], NULL, 10);
+    if (!strcmp(argv[i], "--prune-every")) prune_every = atoi(argv[i + 1]);
+    if (!strcmp(argv[i], "--prune-threshold")) prune_threshold = atof(argv[i + 1]);
     if (!strcmp(argv[i], "--no-control")) has_control = false;
+    if (!strcmp(argv[i], "--warm-start")) {
+      warm_start = true;
+      strcpy(warmSampleName, argv[i + 1]);
+      strcpy(warmStatName, argv[i + 2]);
+    }
+    if (!strcmp(argv[i], "--warm-start-read-model")) warm_read_model = true;
+    if (!strcmp(argv[i], "--fixed-read-model")) {
+      fixed_read_model = true;
+      strcpy(fixedStatName, argv[i + 1]);
+    }
+    if (!strcmp(argv[i], "--loglik-every")) loglik_every = atoi(argv[i + 1]);
+    if (!strcmp(argv[i], "--param-tolerance")) param_tol = atof(argv[i + 1]);
+    if (!strcmp(argv[i], "--convergence-trace")) convergence_trace = true;
     if (!strcmp(argv[i], "-q")) verbose = false;
   }
 
+  general_assert(!warm_read_model || warm_start, "--warm-start-read-model requires --warm-start!");
+  general_assert(!fixed_read_model || !warm_read_model, "--fixed-read-model and --warm-start-read-model cannot be used together!");
+  general_assert(!fixed_read_model || !output_logMAP, "--output-logMAP requires learning the read models, it cannot be used with --fixed-read-model!");
+  general_assert(loglik_every >= 0, "--loglik-every must be non-negative!");
+  general_assert(param_tol >= 0.0 || loglik_every > 0, "--loglik-every 0 requires --param-tolerance, otherwise EM cannot check convergence!");
+  general_assert(read_model_min_rounds >= 1 && read_model_min_rounds <= read_model_max_rounds, "--read-model-min-rounds must be at least 1 and no more than --read-model-max-rounds!");
+
   init();
   EM();
   writeResults();
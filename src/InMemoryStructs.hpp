@@ -1,34 +1,51 @@
 #ifndef INMEMORYSTRUCTS_H_
 #define INMEMORYSTRUCTS_H_
 
+#include<cstring>
 #include<vector>
+#include<stdint.h>
 
 #include "utils.h"
 
 // In memory alignment
 struct InMemAlign {
   int tid, pos, fragment_length;
+  int idx; // index of this alignment in its read's alignment group, kept when alignments are pruned
   double conprb, frac; // conprb, the conditional probability of generating the read based on read_model; frac the expected weight
 
-  InMemAlign() : tid(0), pos(0), fragment_length(0), conprb(0.0), frac(0.0) {}
+  InMemAlign() : tid(0), pos(0), fragment_length(0), idx(0), conprb(0.0), frac(0.0) {}
+};
+
+// Entry of a transcript's alignment index, alignments are stored sorted by pos so that the scatter into count arrays is sequential
+struct InMemAlignIdx {
+  int pos; // leftmost position from 5' end, where the fragment ends
+  int start_pos; // position where the fragment starts, -1 for SE reads
+  const double *frac; // points to the expected weight of the indexed InMemAlign
+
+  InMemAlignIdx() : pos(0), start_pos(-1), frac(NULL) {}
 };
 
 // In memory alignment group
 struct InMemAlignG {
   int size; 
+  int mult; // number of identical reads this group stands for, more than 1 if PROBer-parse-alignments collapsed duplicates; the fracs of its alignments are summed over all copies
   double noise_conprb;
+  uint16_t comp[5]; // counts of A, C, G, T and N over both mates, see NoiseProfile::addComposition
+  bool sampled; // if the read model is trained on this read, false only for reads left out by PROBer-run-em --read-model-sample
 
-  InMemAlignG() : size(0), noise_conprb(0.0) {}
+  InMemAlignG() : size(0), mult(1), noise_conprb(0.0), sampled(true) { memset(comp, 0, sizeof(comp)); }
 };
 
 // Store in memory information for all alignments of a thread
 struct InMemChunk {
   READ_INT_TYPE pos, nreads;
+  HIT_INT_TYPE nlines; // number of alignments currently stored
   InMemAlign *aligns, *pointer;
   InMemAlignG *reads;
 
   InMemChunk(READ_INT_TYPE nreads, HIT_INT_TYPE nlines) {
     this->nreads = nreads;
+    this->nlines = nlines;
     reads = new InMemAlignG[nreads];
     --reads; // because reads[1] is the start position
     aligns = new InMemAlign[nlines];
@@ -60,6 +77,38 @@ struct InMemChunk {
     return true;
   }
 
+  /*
+    @param   threshold   alignments whose frac per read copy is below threshold are dropped, except each read's best alignment
+    @return  number of alignments dropped
+    @comment: Compact alignments in place. Alignments with conprb <= 0, i.e. discarded ones (conprb == -1.0) and those whose probability underflowed to 0, always get zero weight,
+              so they are dropped as well and never kept as the best. Reads keep their order, the alignments of a read may shrink to none if all have conprb <= 0.
+   */
+  HIT_INT_TYPE prune(double threshold) {
+    InMemAlign *src = aligns, *dest = aligns;
+    HIT_INT_TYPE ndropped = 0;
+
+    for (READ_INT_TYPE i = 1; i <= nreads; ++i) {
+      int size = reads[i].size, best = -1, new_size = 0;
+      double read_threshold = threshold * reads[i].mult;
+
+      for (int j = 0; j < size; ++j) 
+	if (src[j].conprb > 0.0 && (best < 0 || src[j].frac > src[best].frac)) best = j;
+      // dest + new_size never passes src + j, so entries are moved before being overwritten
+      for (int j = 0; j < size; ++j) 
+	if (j == best || (src[j].conprb > 0.0 && src[j].frac >= read_threshold)) dest[new_size++] = src[j];
+
+      reads[i].size = new_size;
+      ndropped += size - new_size;
+      src += size;
+      dest += new_size;
+    }
+
+    nlines -= ndropped;
+    reset();
+
+    return ndropped;
+  }
+
   ~InMemChunk() {
     ++reads;
     delete[] reads;
@@ -27,6 +27,8 @@ Markov::Markov() {
   probI[0] = probI[1] = probI[2] = probI[3] = (1.0 - 1e-5) / 4.0;
   probI[4] = 1e-5;
 
+  calcLogTables();
+
   P_start_sim = NULL;
   P_trans_sim = NULL;
   probI_sim = NULL;
@@ -64,6 +66,8 @@ void Markov::finish() {
   for (int i = 0; i < NCODES; ++i) sum += probI[i];
   if (isZero(sum)) memset(probI, 0, sizeof(probI));
   else for (int i = 0; i < NCODES; ++i) probI[i] /= sum;
+
+  calcLogTables();
 }
 
 void Markov::read(std::ifstream& fin) {
@@ -85,6 +89,8 @@ void Markov::read(std::ifstream& fin) {
   for (int i = 0; i < NCODES; ++i) assert(fin>> probI[i]);
   
   getline(fin, line);
+
+  calcLogTables();
 }
 
 void Markov::write(std::ofstream& fout) {
@@ -103,6 +109,13 @@ void Markov::write(std::ofstream& fout) {
   fout<< probI[NCODES - 1]<< std::endl << std::endl;
 }
 
+void Markov::calcLogTables() {
+  for (int i = 0; i < NSTATES; ++i) logP_start[i] = safeLog(P_start[i]);
+  for (int i = 0; i < NSTATES; ++i)
+    for (int j = 0; j < NSTATES; ++j) logP_trans[i][j] = safeLog(P_trans[i][j]);
+  for (int i = 0; i < NCODES; ++i) logProbI[i] = safeLog(probI[i]);
+}
+
 void Markov::startSimulation() {
   P_start_sim = new double[NSTATES];
   memcpy(P_start_sim, P_start, sizeof(P_start));
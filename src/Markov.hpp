@@ -16,6 +16,11 @@ public:
   
   double getIBaseProb(int code) { return probI[code]; }
 
+  // log-domain versions, tables are refreshed whenever parameters are finished or read
+  double getLogProb(char a) const { return logP_start[chr2state[a]]; }
+  double getLogProb(char a, char b) const { return logP_trans[chr2state[a]][chr2state[b]]; }
+  double getIBaseLogProb(int code) const { return logProbI[code]; }
+
   void update(char a, double frac) { P_start[chr2state[a]] += frac; }
   void update(char a, char b, double frac) { P_trans[chr2state[a]][chr2state[b]] += frac; }
 
@@ -25,6 +30,13 @@ public:
   void collect(const Markov* o);
   void finish();
 
+  // append all probabilities to params, used to measure how much the model changes between EM rounds
+  void appendParams(std::vector<double>& params) const {
+    params.insert(params.end(), P_start, P_start + NSTATES);
+    params.insert(params.end(), (const double*)P_trans, (const double*)P_trans + NSTATES * NSTATES);
+    params.insert(params.end(), probI, probI + NCODES);
+  }
+
   void read(std::ifstream& fin);
   void write(std::ofstream& fout);
 
@@ -69,6 +81,10 @@ private:
   
   double probI[NCODES]; // The probability of generating a base given the state is I
 
+  double logP_start[NSTATES], logP_trans[NSTATES][NSTATES], logProbI[NCODES]; // logs of the above
+
+  void calcLogTables();
+
   // for simulation
   double *P_start_sim;
   double (*P_trans_sim)[NSTATES];
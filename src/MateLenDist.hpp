@@ -19,10 +19,10 @@ public:
     return (len != upper_bound ? pmf[len - lb] : pmf[len - lb] + (cdf[span - 1] - cdf[len - lb]));
   }
     
-  void update(int len, bool is_noise = false) {
+  void update(int len, bool is_noise = false, int count = 1) {
     if (len > ub) { ub = len; pmf.resize(ub + 1, 0.0); noise_counts.resize(ub + 1, 0.0); }
-    ++pmf[len];
-    if (is_noise) ++noise_counts[len];
+    pmf[len] += count;
+    if (is_noise) noise_counts[len] += count;
   }
 
   void finish();
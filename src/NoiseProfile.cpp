@@ -9,6 +9,7 @@
 
 NoiseProfile::NoiseProfile(bool hasCount) {
   memset(p, 0, sizeof(p));
+  calcLogTable();
   c = pc = NULL;
   if (hasCount) { 
     c = new double[NCODES];
@@ -41,6 +42,7 @@ void NoiseProfile::calcInitParams() {
   // one pseudo count for each base 
   for (int i = 0; i < NCODES; ++i) sum += (1.0 + c[i]);
   for (int i = 0; i < NCODES; ++i) p[i] = (1.0 + c[i]) / sum;
+  calcLogTable();
 }
 
 void NoiseProfile::init() {
@@ -50,6 +52,7 @@ void NoiseProfile::init() {
 void NoiseProfile::collect(const NoiseProfile* o) {
   for (int i = 0; i < NCODES; ++i)
     p[i] += o->p[i];
+  calcLogTable(); // a copy of o, as warm start does, is ready to use
 }
 
 void NoiseProfile::finish() {
@@ -58,6 +61,7 @@ void NoiseProfile::finish() {
   for (int i = 0; i < NCODES; ++i) sum += (p[i] + c[i]);
   if (isZero(sum)) memset(p, 0, sizeof(p)); 
   else for (int i = 0; i < NCODES; ++i) p[i] = (p[i] + c[i]) / sum;
+  calcLogTable();
 }
 
 double NoiseProfile::calcLogP() {
@@ -81,6 +85,7 @@ void NoiseProfile::read(std::ifstream& fin) {
     assert(fin>> p[i]);
 
   getline(fin, line);
+  calcLogTable();
 }
 
 void NoiseProfile::write(std::ofstream& fout) {
@@ -1,9 +1,11 @@
 #ifndef NOISEPROFILE_H_
 #define NOISEPROFILE_H_
 
+#include<cmath>
 #include<cstring>
 #include<string>
 #include<fstream>
+#include<stdint.h>
 
 #include "utils.h"
 #include "sampling.hpp"
@@ -26,27 +28,37 @@ public:
 
   void calcInitParams();
 
-  double getProb(const SEQstring& seq) {
-    double prob = 1.0;
+  /*
+    @param   seq    a read sequence
+    @param   comp   NCODES base counts, seq's bases are added to them
+    @comment: the noise probability of a read only depends on its base composition, which is counted once when reads are loaded
+   */
+  static void addComposition(const SEQstring& seq, uint16_t* comp) {
     int len = seq.getLen();
-    
     for (int i = 0; i < len; ++i) {
-      prob *= p[seq.baseCodeAt(i)];
+      ++comp[seq.baseCodeAt(i)];
     }
-    
-    return prob;
+  }
+
+  // comp, base composition from addComposition
+  double getProb(const uint16_t* comp) const {
+    double logprob = 0.0;
+    for (int i = 0; i < NCODES; ++i) logprob += comp[i] * logp[i];
+    return exp(logprob);
   }
   
-  void update(const SEQstring& seq, double frac) {
-    int len = seq.getLen();
-    for (int i = 0; i < len; ++i) {
-      p[seq.baseCodeAt(i)] += frac;
-    }
+  void update(const uint16_t* comp, double frac) {
+    for (int i = 0; i < NCODES; ++i) p[i] += frac * comp[i];
   }
 
   void init();
   void collect(const NoiseProfile* o);
   void finish();
+
+  // append all probabilities to params, used to measure how much the profile changes between EM rounds
+  void appendParams(std::vector<double>& params) const {
+    params.insert(params.end(), p, p + NCODES);
+  }
   
   double calcLogP();
 
@@ -67,9 +79,14 @@ private:
   static const int NCODES = 5;
 
   double p[NCODES];
+  double logp[NCODES]; // log of p, refreshed whenever p is set up, collected, finished or read
   double *c; // counts in N0
 
   double *pc; // for simulation
+
+  void calcLogTable() {
+    for (int i = 0; i < NCODES; ++i) logp[i] = safeLog(p[i]);
+  }
 };
 
 #endif /* NOISEPROFILE_H_ */
@@ -1,8 +1,11 @@
+#include<cmath>
 #include<cassert>
 #include<string>
 #include<fstream>
+#include<algorithm>
 
 #include "utils.h"
+#include "my_assert.h"
 #include "sampling.hpp"
 
 #include "Refs.hpp"
@@ -25,6 +28,8 @@ PROBerReadModel::PROBerReadModel(int model_type, Refs* refs, int read_length) :
 
   max_len = 0;
   loglik = 0.0;
+  param_change = 1.0;
+  fixed = false;
   sampler = NULL;
 }
 
@@ -35,6 +40,8 @@ PROBerReadModel::PROBerReadModel(PROBerReadModel* master_model) {
   model_type = master_model->model_type;
   max_len = master_model->max_len;
   loglik = 0.0;
+  param_change = 1.0;
+  fixed = false;
 
   npro = new NoiseProfile();
   seqmodel = new SequencingModel((model_type & 1), max_len);
@@ -53,6 +60,8 @@ PROBerReadModel::PROBerReadModel(Refs* refs, Sampler* sampler) : refs(refs), sam
 
   max_len = 0;
   loglik = 0.0;
+  param_change = 1.0;
+  fixed = false;
 
   read_length = -1;
 }
@@ -69,6 +78,8 @@ PROBerReadModel::~PROBerReadModel() {
 }
 
 void PROBerReadModel::finish_preprocess() {
+  if (fixed) return;
+
   loglik = 0.0;
   mld1->finish();
   loglik += mld1->getLogP();
@@ -97,6 +108,23 @@ void PROBerReadModel::collect(PROBerReadModel* o) {
 void PROBerReadModel::finish() {
   seqmodel->finish();
   npro->finish();
+  snapshotParams();
+}
+
+void PROBerReadModel::snapshotParams() {
+  std::vector<double> params;
+
+  seqmodel->appendParams(params);
+  npro->appendParams(params);
+
+  param_change = 1.0;
+  if (last_params.size() == params.size()) {
+    param_change = 0.0;
+    for (size_t i = 0; i < params.size(); ++i) 
+      param_change = std::max(param_change, fabs(params[i] - last_params[i]));
+  }
+
+  last_params.swap(params);
 }
 
 void PROBerReadModel::read(const char* modelF) {
@@ -141,6 +169,48 @@ void PROBerReadModel::read(const char* modelF) {
   if (verbose) printf("PROBerReadModel::read finished!\n");
 }
 
+void PROBerReadModel::warmStart(const char* modelF) {
+  PROBerReadModel prev(refs, NULL);
+
+  prev.read(modelF);
+  general_assert(prev.model_type == model_type, "Read model " + cstrtos(modelF) + " has model type " + itos(prev.model_type) + " but the data have model type " + itos(model_type) + "!");
+
+  // Without quality scores, the sequencing model's profile length must match the current maximum mate length
+  int prev_max_len = prev.mld1->getMaxL();
+  if (model_type >= 2 && prev_max_len < prev.mld2->getMaxL()) prev_max_len = prev.mld2->getMaxL();
+  general_assert((model_type & 1) || prev_max_len == max_len, "Read model " + cstrtos(modelF) + " was learned from reads up to " + itos(prev_max_len) + " bases, but current reads are up to " + itos(max_len) + " bases!");
+
+  std::swap(seqmodel, prev.seqmodel);
+
+  npro->init();
+  npro->collect(prev.npro);
+
+  snapshotParams(); // the first update is measured against the previous run's parameters
+}
+
+void PROBerReadModel::loadFixed(const char* modelF) {
+  PROBerReadModel prev(refs, NULL);
+
+  prev.read(modelF);
+  general_assert(prev.model_type == model_type, "Read model " + cstrtos(modelF) + " has model type " + itos(prev.model_type) + " but the data have model type " + itos(model_type) + "!");
+
+  std::swap(mld1, prev.mld1);
+  std::swap(mld2, prev.mld2);
+  std::swap(qd, prev.qd);
+  std::swap(seqmodel, prev.seqmodel);
+
+  // take the previous noise probabilities; the N0 counts stay empty because update_preprocess only checks mate lengths for a fixed model,
+  // so calcLogP returns 0 and the unalignable reads' term, a constant, is left out of the log likelihood
+  npro->init();
+  npro->collect(prev.npro);
+
+  max_len = mld1->getMaxL();
+  if (model_type >= 2 && max_len < mld2->getMaxL()) max_len = mld2->getMaxL();
+
+  loglik = 0.0; // the unalignable reads' terms are constant and left out
+  fixed = true;
+}
+
 void PROBerReadModel::write(const char* modelF) {
   std::ofstream fout(modelF);
   assert(fout.is_open());
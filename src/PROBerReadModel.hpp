@@ -3,10 +3,12 @@
 
 #include<cassert>
 #include<string>
+#include<vector>
 #include<fstream>
 #include<algorithm>
 
 #include "utils.h"
+#include "my_assert.h"
 #include "sampling.hpp"
 
 #include "RefSeq.hpp"
@@ -57,10 +59,22 @@ public:
    */
   int getModelType() const { return model_type; }
 
-  void update_preprocess(AlignmentGroup& ag, bool isAligned);
+  /*
+    @param   ag          a read
+    @param   isAligned   if the read is alignable
+    @param   count       number of identical copies of this read, only alignable reads are collapsed
+   */
+  void update_preprocess(AlignmentGroup& ag, bool isAligned, int count = 1);
 
   void finish_preprocess();
 
+  /*
+    @param   ag_in_mem   an in-memory alignment group
+    @param   ag          the read
+    @comment: count the bases of the read into ag_in_mem->comp, call once before setConProbs
+   */
+  void setComposition(InMemAlignG* ag_in_mem, AlignmentGroup& ag);
+
   /*
     @param   ag_in_mem   an in-memory alignment group, recorded information necessary for EM iteration
     @param   aligns      a pointer to all alignments in ag_in_mem
@@ -74,8 +88,9 @@ public:
     @param   aligns
     @param   ag
     @param   noise_frac   fractional weight at noise transcript
+    @param   weight       number of reads this read stands for if the model is trained on a sample of reads
    */
-  void update(InMemAlignG* ag_in_mem, InMemAlign* aligns, AlignmentGroup& ag, double noise_frac);
+  void update(InMemAlignG* ag_in_mem, InMemAlign* aligns, AlignmentGroup& ag, double noise_frac, double weight = 1.0);
 
   /*
     @return  partial log-likelihood for unalignable reads
@@ -88,7 +103,32 @@ public:
   void collect(PROBerReadModel* o);
   void finish();
 
+  /*
+    @return  the largest absolute change of any sequencing model or noise profile probability made by the last finish(), 1.0 if there is nothing to compare with
+    @comment: mate length and quality distributions are fixed after preprocessing and are not counted
+   */
+  double getParamChange() const { return param_change; }
+
   void read(const char* modelF);
+
+  /*
+    @param   modelF   a read model file written by a previous run
+    @comment: Replace the sequencing model and noise profile parameters with the previous run's. Mate length and quality distributions are kept from the current data. Call after finish_preprocess().
+   */
+  void warmStart(const char* modelF);
+
+  /*
+    @param   modelF   a read model file written by a previous run
+    @comment: Use all parameters of modelF, including the mate length and quality distributions, as fixed input. Call before preprocessing.
+              Afterwards update_preprocess only checks mate lengths and finish_preprocess does nothing, so setConProbs can be called while preprocessing.
+   */
+  void loadFixed(const char* modelF);
+
+  /*
+    @return  true if the parameters are fixed by loadFixed()
+   */
+  bool isFixed() const { return fixed; }
+
   void write(const char* modelF);
 
   void simulate(READ_INT_TYPE rid, int tid, int pos, int fragment_length, std::ofstream* out1, std::ofstream* out2 = NULL);
@@ -106,6 +146,15 @@ private:
 
   int max_len; // maximum mate length
   double loglik; // partial log-likelihood for unaligned reads
+  bool fixed; // if parameters are loaded by loadFixed() and never learned
+
+  std::vector<double> last_params; // sequencing model and noise profile probabilities after the last finish() or warmStart()
+  double param_change; // see getParamChange()
+
+  /*
+    @comment: record the current probabilities in last_params and set param_change to the largest change since the previous record
+   */
+  void snapshotParams();
 
   Refs *refs;  
   Sampler *sampler;
@@ -113,25 +162,39 @@ private:
   int read_length; // the minimum read length, if read_length is set (not -1), all mates have a same length.
 };
 
-inline void PROBerReadModel::update_preprocess(AlignmentGroup& ag, bool isAligned) {
+inline void PROBerReadModel::update_preprocess(AlignmentGroup& ag, bool isAligned, int count) {
+  int len;
+
+  // A fixed model can only score mate lengths it has seen
+  if (fixed) {
+    len = read_length < 0 ? ag.getSeqLength(1) : read_length;
+    general_assert(len >= mld1->getMinL() && len <= mld1->getMaxL(), "Mate length " + itos(len) + " is outside of the fixed read model's range [" + itos(mld1->getMinL()) + ", " + itos(mld1->getMaxL()) + "]!");
+    if (model_type >= 2) {
+      len = read_length < 0 ? ag.getSeqLength(2) : read_length;
+      general_assert(len >= mld2->getMinL() && len <= mld2->getMaxL(), "Mate length " + itos(len) + " is outside of the fixed read model's range [" + itos(mld2->getMinL()) + ", " + itos(mld2->getMaxL()) + "]!");
+    }
+    return;
+  }
+
   // Update MLDs
-  int len = read_length < 0 ? ag.getSeqLength(1) : read_length;
-  mld1->update(len, !isAligned);
+  len = read_length < 0 ? ag.getSeqLength(1) : read_length;
+  mld1->update(len, !isAligned, count);
   if (model_type >= 2) {
     len = read_length < 0 ? ag.getSeqLength(2) : read_length;
-    mld2->update(len, !isAligned);
+    mld2->update(len, !isAligned, count);
   }
   
   // Updae QualDist
   if (model_type & 1) {
     QUALstring qual;
-    ag.getQUAL(qual); qd->update(qual);
+    ag.getQUAL(qual); qd->update(qual, count);
     if (model_type == 3) {
-      ag.getQUAL(qual, 2); qd->update(qual);
+      ag.getQUAL(qual, 2); qd->update(qual, count);
     }
   }
   
   // Update NoiseProfile
+  assert(isAligned || count == 1);
   if (!isAligned) {
     SEQstring seq;
     ag.getSEQ(seq); npro->updateC(seq);
@@ -141,25 +204,41 @@ inline void PROBerReadModel::update_preprocess(AlignmentGroup& ag, bool isAligne
   }
 }
 
+inline void PROBerReadModel::setComposition(InMemAlignG* ag_in_mem, AlignmentGroup& ag) {
+  SEQstring seq;
+
+  general_assert(ag.getSeqLength() + (model_type >= 2 ? ag.getSeqLength(2) : 0) <= 65535, "Read " + ag.getName() + " is too long!");
+  memset(ag_in_mem->comp, 0, sizeof(ag_in_mem->comp));
+  assert(ag.getSEQ(seq));
+  NoiseProfile::addComposition(seq, ag_in_mem->comp);
+  if (model_type >= 2) {
+    assert(ag.getSEQ(seq, 2));
+    NoiseProfile::addComposition(seq, ag_in_mem->comp);
+  }
+}
+
 inline void PROBerReadModel::setConProbs(InMemAlignG* ag_in_mem, InMemAlign* aligns, AlignmentGroup& ag) {
   int seqlen;
   SEQstring seq; // seq, qual and cigar must be in each function since we have multiple threads!
   QUALstring qual;
   CIGARstring cigar;
+  ReadCache rc; // a multi-mapping read is decoded once per mate and shared by all its alignments
+  bool shared = ag_in_mem->size > 1;
   const RefSeq* refseq = NULL;
   
   // Get read sequences and quality scores
   assert(ag.getSEQ(seq));
   seqlen = read_length < 0 ? ag.getSeqLength() : read_length;
   if (model_type & 1) assert(ag.getQUAL(qual));
-  // set noise probability    
-  ag_in_mem->noise_conprb = mld1->getProb(seqlen) * npro->getProb(seq);
+  if (shared) seqmodel->setUpRead('+', &seq, ((model_type & 1) ? &qual : NULL), rc);
+  // set noise probability, comp already covers both mates
+  ag_in_mem->noise_conprb = mld1->getProb(seqlen) * npro->getProb(ag_in_mem->comp);
   // set alignment probabilities
   for (int i = 0; i < ag_in_mem->size; ++i) if (aligns[i].conprb != -1.0) {
     refseq = refs->getRef(aligns[i].tid);
     assert(ag.getAlignment(i)->getCIGAR(cigar));
     aligns[i].conprb = (aligns[i].fragment_length > 0 ? mld1->getProb(seqlen, aligns[i].fragment_length) : mld1->getProb(seqlen)) * \
-      seqmodel->getProb('+', aligns[i].pos, refseq, &cigar, &seq, ((model_type & 1) ? &qual : NULL));
+      (shared ? exp(seqmodel->getLogProb(aligns[i].pos, refseq, &cigar, rc)) : seqmodel->getProb('+', aligns[i].pos, refseq, &cigar, &seq, ((model_type & 1) ? &qual : NULL)));
   }
   
   if (model_type >= 2) {
@@ -167,18 +246,20 @@ inline void PROBerReadModel::setConProbs(InMemAlignG* ag_in_mem, InMemAlign* ali
     assert(ag.getSEQ(seq, 2));
     seqlen = read_length < 0 ? ag.getSeqLength(2) : read_length;
     if (model_type & 1) assert(ag.getQUAL(qual, 2));
-    ag_in_mem->noise_conprb *= mld2->getProb(seqlen) * npro->getProb(seq);
+    if (shared) seqmodel->setUpRead('-', &seq, ((model_type & 1) ? &qual : NULL), rc);
+    ag_in_mem->noise_conprb *= mld2->getProb(seqlen);
     for (int i = 0; i < ag_in_mem->size; ++i) if (aligns[i].conprb != -1.0) {
       refseq = refs->getRef(aligns[i].tid);
       assert(ag.getAlignment(i)->getCIGAR(cigar, 2));
       assert(aligns[i].fragment_length > 0);
       aligns[i].conprb *= mld2->getProb(seqlen, aligns[i].fragment_length) * \
-	seqmodel->getProb('-', refseq->getLen() - aligns[i].pos - aligns[i].fragment_length, refseq, &cigar, &seq, ((model_type & 1) ? &qual : NULL));
+	(shared ? exp(seqmodel->getLogProb(refseq->getLen() - aligns[i].pos - aligns[i].fragment_length, refseq, &cigar, rc)) : \
+	 seqmodel->getProb('-', refseq->getLen() - aligns[i].pos - aligns[i].fragment_length, refseq, &cigar, &seq, ((model_type & 1) ? &qual : NULL)));
     }
   }
 }
 
-inline void PROBerReadModel::update(InMemAlignG* ag_in_mem, InMemAlign* aligns, AlignmentGroup& ag, double noise_frac) {
+inline void PROBerReadModel::update(InMemAlignG* ag_in_mem, InMemAlign* aligns, AlignmentGroup& ag, double noise_frac, double weight) {
   SEQstring seq;
   QUALstring qual;
   CIGARstring cigar;
@@ -186,27 +267,25 @@ inline void PROBerReadModel::update(InMemAlignG* ag_in_mem, InMemAlign* aligns,
   
   assert(ag.getSEQ(seq));
   if (model_type & 1) assert(ag.getQUAL(qual));
-  // update noise prob
-  npro->update(seq, noise_frac);
+  // update noise prob, both mates at once
+  npro->update(ag_in_mem->comp, noise_frac * weight);
   // update alignment probs
   for (int i = 0; i < ag_in_mem->size; ++i) if (aligns[i].frac > 0.0) {
     refseq = refs->getRef(aligns[i].tid);
     assert(ag.getAlignment(i)->getCIGAR(cigar));
-    seqmodel->update(aligns[i].frac, '+', aligns[i].pos, refseq, &cigar, &seq, ((model_type & 1) ? &qual : NULL));
+    seqmodel->update(aligns[i].frac * weight, '+', aligns[i].pos, refseq, &cigar, &seq, ((model_type & 1) ? &qual : NULL));
   }
 
   if (model_type >= 2) {
     // paired-end reads
     assert(ag.getSEQ(seq, 2));
     if (model_type & 1) assert(ag.getQUAL(qual, 2));
-    // update noise prob
-    npro->update(seq, noise_frac);
     // update alignment probs
     for (int i = 0; i < ag_in_mem->size; ++i) if (aligns[i].frac > 0.0) {
       refseq = refs->getRef(aligns[i].tid);
       assert(ag.getAlignment(i)->getCIGAR(cigar, 2));
       assert(aligns[i].fragment_length > 0);
-      seqmodel->update(aligns[i].frac, '-', refseq->getLen() - aligns[i].pos - aligns[i].fragment_length, refseq, &cigar, &seq, ((model_type & 1) ? &qual : NULL));
+      seqmodel->update(aligns[i].frac * weight, '-', refseq->getLen() - aligns[i].pos - aligns[i].fragment_length, refseq, &cigar, &seq, ((model_type & 1) ? &qual : NULL));
     }
   }
 } 
@@ -7,6 +7,7 @@
 
 #include "utils.h"
 #include "sampling.hpp"
+#include "VecKernels.hpp"
 #include "PROBerTransModel.hpp"
 
 const double PROBerTransModel::INF = 1000.0;
@@ -33,12 +34,16 @@ bool PROBerTransModel::isMAP = true; // default is true
 bool PROBerTransModel::learning = false; // default is simulation
 int PROBerTransModel::state = 0;
 
+PROBerTransModel::EMStepFunc PROBerTransModel::emStepFunc = NULL;
+PROBerTransModel::CalcAuxFunc PROBerTransModel::calcAuxFuncs[2] = { NULL, NULL };
+
 void PROBerTransModel::setGlobalParams(int primer_length, int min_frag_len, int max_frag_len, int init_state) { 
   assert(primer_length <= min_frag_len && min_frag_len <= max_frag_len);
   PROBerTransModel::primer_length = primer_length;
   PROBerTransModel::min_frag_len = min_frag_len - primer_length;
   PROBerTransModel::max_frag_len = max_frag_len - primer_length;
   state = init_state;
+  selectKernels();
 }
 
 void PROBerTransModel::setLearningRelatedParams(double gamma_init, double beta_init, double base, int read_length, bool isMAP) {
@@ -61,11 +66,39 @@ void PROBerTransModel::setLearningRelatedParams(double gamma_init, double beta_i
     defaults[0] = dgamma * log(gamma_init) + cgamma * log(1.0 - gamma_init);
     defaults[1] = dbeta * log(beta_init) + cbeta * log(1.0 - beta_init);
   }
+
+  selectKernels();
 }
 
+void PROBerTransModel::selectKernels() {
+  if (isMAP) {
+    calcAuxFuncs[0] = &PROBerTransModel::calcAuxiliaryArrays_kernel<0, true>;
+    calcAuxFuncs[1] = &PROBerTransModel::calcAuxiliaryArrays_kernel<1, true>;
+  }
+  else {
+    calcAuxFuncs[0] = &PROBerTransModel::calcAuxiliaryArrays_kernel<0, false>;
+    calcAuxFuncs[1] = &PROBerTransModel::calcAuxiliaryArrays_kernel<1, false>;
+  }
 
+  switch(state) {
+  case 0: emStepFunc = isMAP ? &PROBerTransModel::EM_step_kernel<0, true> : &PROBerTransModel::EM_step_kernel<0, false>; break;
+  case 1: emStepFunc = isMAP ? &PROBerTransModel::EM_step_kernel<1, true> : &PROBerTransModel::EM_step_kernel<1, false>; break;
+  case 2: emStepFunc = isMAP ? &PROBerTransModel::EM_step_kernel<2, true> : &PROBerTransModel::EM_step_kernel<2, false>; break;
+  case 3: emStepFunc = isMAP ? &PROBerTransModel::EM_step_kernel<3, true> : &PROBerTransModel::EM_step_kernel<3, false>; break;
+  default: assert(false);
+  }
+}
+
+
+
+void PROBerTransModel::reserveParams(SlabArena* arena, int transcript_length) {
+  int len = transcript_length - primer_length;
+
+  arena->reserve(len + 1);
+  if (getState() > 0) arena->reserve(len + 1);
+}
 
-PROBerTransModel::PROBerTransModel(int tid, const std::string& name, int transcript_length) : tid(tid), name(name) {  
+PROBerTransModel::PROBerTransModel(int tid, const std::string& name, int transcript_length, SlabArena* arena) : tid(tid), name(name) {  
   gamma = beta = NULL;
   start = end = NULL;
   dcm = ccm = NULL;
@@ -75,11 +108,16 @@ PROBerTransModel::PROBerTransModel(int tid, const std::string& name, int transcr
   margin_prob2 = NULL;
 
   start2 = end2 = NULL;
-  for (int i = 0; i < 2; ++i) alignmentsArr[i].clear();
+  for (int i = 0; i < 2; ++i) {
+    alignmentsArr[i].clear();
+    numAligns[i] = numIndexed[i] = 0;
+    alignIndex[i] = NULL;
+  }
 
   len = efflen = -1; 
   efflen2 = -1;
   N_obs[0] = N_obs[1] = 0.0;
+  param_change = 0.0;
   prob_pass[0] = prob_pass[1] = 1.0; // In case no alignments, unobserved read counts is 0
 
   delta = 0.0;
@@ -91,6 +129,8 @@ PROBerTransModel::PROBerTransModel(int tid, const std::string& name, int transcr
 
   cdf_end = NULL;
 
+  paramsInArena = arraysInArena = false;
+
   if (!learning) return;
 
   len = transcript_length - primer_length;
@@ -98,20 +138,26 @@ PROBerTransModel::PROBerTransModel(int tid, const std::string& name, int transcr
   delta = 1.0 / (len + (primer_length > 0 ? 1.0 : 0.0));
   
   // If a transcript is excluded from analysis, all its gamma/beta values become 0
-  gamma = new double[len + 1];
+  paramsInArena = (arena != NULL);
+  gamma = paramsInArena ? arena->alloc(len + 1) : new double[len + 1];
   memset(gamma, 0, sizeof(double) * (len + 1));
 
   if (getState() > 0) {
-    beta = new double[len + 1];
+    beta = paramsInArena ? arena->alloc(len + 1) : new double[len + 1];
     memset(beta, 0, sizeof(double) * (len + 1));
   }
 }
 
 PROBerTransModel::~PROBerTransModel() {
-  if (gamma != NULL) delete[] gamma;
-  if (beta != NULL) delete[] beta;
+  if (!paramsInArena) {
+    if (gamma != NULL) delete[] gamma;
+    if (beta != NULL) delete[] beta;
+  }
 
-  if (efflen <= 0) return;
+  for (int i = 0; i < 2; ++i) 
+    if (alignIndex[i] != NULL) delete[] alignIndex[i];
+
+  if (efflen <= 0 || arraysInArena) return;
 
   if (start != NULL) delete[] start;
   if (end != NULL) delete[] end;
@@ -128,7 +174,22 @@ PROBerTransModel::~PROBerTransModel() {
   if (end_se != NULL) delete[] end_se;
 }
 
-void PROBerTransModel::init() {
+void PROBerTransModel::reserveArrays(SlabArena* arena) const {
+  arena->reserve(len + 1); // start
+  arena->reserve(len + 1); // end
+  arena->reserve(len + 1); // logsum
+  arena->reserve(efflen); // margin_prob
+  if (getState() == 2) {
+    arena->reserve(len + 1); // dcm
+    arena->reserve(len + 1); // ccm
+  }
+  if (hasSE) {
+    arena->reserve(len + 1); // end_se
+    if (len - min_alloc_len + 1 != efflen) arena->reserve(len - min_alloc_len + 1); // margin_prob2
+  }
+}
+
+void PROBerTransModel::init(SlabArena* arena) {
   int state = getState();
 
   assert(state < 3);
@@ -137,27 +198,29 @@ void PROBerTransModel::init() {
   if (state != 1) for (int i = 1; i <= len; ++i) gamma[i] = gamma_init;
   if (state != 0) for (int i = 1; i <= len; ++i) beta[i] = beta_init;
 
+  arraysInArena = (arena != NULL);
+
   // count vectors for fragment starts and ends
-  start = new double[len + 1];
-  end = new double[len + 1];
+  start = arraysInArena ? arena->alloc(len + 1) : new double[len + 1];
+  end = arraysInArena ? arena->alloc(len + 1) : new double[len + 1];
   memset(start, 0, sizeof(double) * (len + 1));
   memset(end, 0, sizeof(double) * (len + 1));
 
   // Auxiliary arrays
-  logsum = new double[len + 1];
-  margin_prob = new double[efflen];
+  logsum = arraysInArena ? arena->alloc(len + 1) : new double[len + 1];
+  margin_prob = arraysInArena ? arena->alloc(efflen) : new double[efflen];
   memset(logsum, 0, sizeof(double) * (len + 1));
   memset(margin_prob, 0, sizeof(double) * efflen);
   
   if (state == 2) {
-    dcm = new double[len + 1];
-    ccm = new double[len + 1];
+    dcm = arraysInArena ? arena->alloc(len + 1) : new double[len + 1];
+    ccm = arraysInArena ? arena->alloc(len + 1) : new double[len + 1];
     memset(dcm, 0, sizeof(double) * (len + 1));
     memset(ccm, 0, sizeof(double) * (len + 1));
   }
   
   if (hasSE) {
-    end_se = new double[len + 1];
+    end_se = arraysInArena ? arena->alloc(len + 1) : new double[len + 1];
     memset(end_se, 0, sizeof(double) * (len + 1));
 
     efflen2 = len - min_alloc_len + 1;
@@ -165,85 +228,126 @@ void PROBerTransModel::init() {
     if (efflen2 == efflen) efflen2 = -1; // If equal, do not need to build margin_prob2
 
     if (efflen2 > 0) {
-      margin_prob2 = new double[efflen2];
+      margin_prob2 = arraysInArena ? arena->alloc(efflen2) : new double[efflen2];
       memset(margin_prob2, 0, sizeof(double) * (efflen2));
     }
   }
 }
 
-void PROBerTransModel::calcAuxiliaryArrays(int channel) {
-  double value;
-  int max_pos;
-
-  // Calculate logsum
+template<int CHANNEL, bool MAP>
+void PROBerTransModel::calcAuxiliaryArrays_kernel() {
+  // Calculate logsum, the log survival factors are independent and computed in SIMD lanes, followed by a block scan
   logsum[0] = 0.0;
-  for (int i = 1; i <= len; ++i) {
-    if (gamma[i] >= 1.0 || (channel == 1 && beta[i] >= 1.0)) value = -INF;
-    else value = (channel == 0 ? log(1.0 - gamma[i]) : log(1.0 - gamma[i]) + log(1.0 - beta[i]));
-    logsum[i] = logsum[i - 1] + value;
-  }
+  if (CHANNEL == 0) VecKernels::logPass(len, gamma + 1, INF, logsum + 1);
+  else VecKernels::logPass(len, gamma + 1, beta + 1, INF, logsum + 1);
+  VecKernels::prefixSum(len + 1, logsum);
 
-  // Calculate margin_prob
+  // Calculate margin_prob, margin_prob[i] temporarily holds the term dropped from the window at i
+  VecKernels::expDiff(efflen - 1, len - max_frag_len, logsum + max_frag_len + 1, logsum + min_frag_len + 1, margin_prob);
   margin_prob[efflen - 1] = 1.0;
   for (int i = efflen - 2, pos = len; i >= 0; --i, --pos) {
-    max_pos = (i + 1) + max_frag_len;
-    assert(max_pos > len || margin_prob[i + 1] - exp(logsum[max_pos] - logsum[pos]) >= 0.0);
-    margin_prob[i] = 1.0 + (channel == 0 ? (1.0 - gamma[pos]) : (1.0 - gamma[pos]) * (1.0 - beta[pos])) * \
-      (max_pos > len ? margin_prob[i + 1] : margin_prob[i + 1] - exp(logsum[max_pos] - logsum[pos]));
+    assert(margin_prob[i + 1] - margin_prob[i] >= 0.0);
+    margin_prob[i] = 1.0 + passProb<CHANNEL>(pos) * (margin_prob[i + 1] - margin_prob[i]);
   }
 
   // Calculate the probability of passing the size selection step
-  prob_pass[channel] = 0.0;
-  for (int i = 0; i < efflen; ++i) {
-    value = delta * margin_prob[i] * exp(logsum[i + min_frag_len] - logsum[i]);
-    if (i > 0) value *= (channel == 0 ? gamma[i] : gamma[i] + beta[i] - gamma[i] * beta[i]);
-    prob_pass[channel] += value;
-  }
+  if (CHANNEL == 0) prob_pass[CHANNEL] = delta * VecKernels::sumEndProbs(efflen, margin_prob, logsum + min_frag_len, logsum, gamma);
+  else prob_pass[CHANNEL] = delta * VecKernels::sumEndProbs(efflen, margin_prob, logsum + min_frag_len, logsum, gamma, beta);
 
   if (efflen2 > 0) {
     // Calculate marginal probability array for allocating SE reads 
+    VecKernels::expDiff(efflen2 - 1, len - max_frag_len, logsum + max_frag_len + 1, logsum + min_alloc_len + 1, margin_prob2);
     margin_prob2[efflen2 - 1] = 1.0;
     for (int i = efflen2 - 2, pos = len; i >= 0; --i, --pos) {
-      max_pos = i + max_frag_len + 1;
-      assert(max_pos > len || margin_prob2[i + 1] - exp(logsum[max_pos] - logsum[pos]) >= 0.0);
-      margin_prob2[i] = 1.0 + (channel == 0 ? (1.0 - gamma[pos]) : (1.0 - gamma[pos]) * (1.0 - beta[pos])) * \
-	(max_pos > len ? margin_prob2[i + 1] : margin_prob2[i + 1] - exp(logsum[max_pos] - logsum[pos]));
+      assert(margin_prob2[i + 1] - margin_prob2[i] >= 0.0);
+      margin_prob2[i] = 1.0 + passProb<CHANNEL>(pos) * (margin_prob2[i + 1] - margin_prob2[i]);
     }
   }
 
-  if (isMAP) {
-    log_prior[channel] = 0.0;
-    if (channel == 0)
-      for (int i = 1; i <= len; ++i) log_prior[channel] += dgamma * log(gamma[i]) + cgamma * log (1.0 - gamma[i]);
-    else 
-      for (int i = 1; i <= len; ++i) log_prior[channel] += dbeta * log(beta[i]) + cbeta * log(1.0 - beta[i]);
+  if (MAP) {
+    if (CHANNEL == 0) log_prior[CHANNEL] = VecKernels::sumLogBeta(len, gamma + 1, dgamma, cgamma);
+    else log_prior[CHANNEL] = VecKernels::sumLogBeta(len, beta + 1, dbeta, cbeta);
   }
 }
 
 void PROBerTransModel::update() {
-  int channel = getChannel();
-  std::vector<InMemAlign*> &alignments = alignmentsArr[channel];
+  double sums[2];
+  double *p_sums = sums;
 
-  HIT_INT_TYPE size = alignments.size();
+  updateSlice(0, numIndexed[getChannel()], start, end, end_se, sums);
+  finishSlices(1, &p_sums);
+}
+
+void PROBerTransModel::updateSlice(HIT_INT_TYPE fr, HIT_INT_TYPE to, double* p_start, double* p_end, double* p_end_se, double* p_sums) {
+  const InMemAlignIdx *alignments = alignIndex[getChannel()];
+  double frac;
 
   // initialize
-  N_obs[channel] = 0.0;
-  memset(start, 0, sizeof(double) * (len + 1));
-  memset(end, 0, sizeof(double) * (len + 1));
+  p_sums[0] = p_sums[1] = 0.0;
+  memset(p_start, 0, sizeof(double) * (len + 1));
+  memset(p_end, 0, sizeof(double) * (len + 1));
+  if (hasSE) memset(p_end_se, 0, sizeof(double) * (len + 1));
+
+  for (HIT_INT_TYPE i = fr; i < to; ++i) {
+    frac = *alignments[i].frac;
+    p_end[alignments[i].pos] += frac;
+    if (alignments[i].start_pos >= 0) {
+      p_start[alignments[i].start_pos] += frac; 
+    }
+    else {
+      p_end_se[alignments[i].pos] += frac;
+      p_sums[1] += frac;
+    }
+    p_sums[0] += frac;
+  }
+}
 
-  N_se = 0.0;
-  if (hasSE) memset(end_se, 0, sizeof(double) * (len + 1));
+void PROBerTransModel::buildAlignmentIndex(int channel) {
+  std::vector<InMemAlign*> &alignments = alignmentsArr[channel];
+  HIT_INT_TYPE size = alignments.size();
+
+  if (size == 0) return;
+  assert(alignIndex[channel] == NULL && size <= numAligns[channel]);
+  numIndexed[channel] = size;
+
+  // counting sort by pos
+  std::vector<HIT_INT_TYPE> offsets(len + 2, 0);
+  for (HIT_INT_TYPE i = 0; i < size; ++i) ++offsets[alignments[i]->pos + 1];
+  for (int i = 1; i <= len; ++i) offsets[i + 1] += offsets[i];
 
+  alignIndex[channel] = new InMemAlignIdx[size];
   for (HIT_INT_TYPE i = 0; i < size; ++i) {
-    end[alignments[i]->pos] += alignments[i]->frac;
-    if (alignments[i]->fragment_length > 0) {
-      start[alignments[i]->pos + alignments[i]->fragment_length - primer_length] += alignments[i]->frac; 
-    }
-    else {
-      end_se[alignments[i]->pos] += alignments[i]->frac;
-      N_se += alignments[i]->frac;
+    InMemAlignIdx &entry = alignIndex[channel][offsets[alignments[i]->pos]++];
+    entry.pos = alignments[i]->pos;
+    entry.start_pos = alignments[i]->fragment_length > 0 ? alignments[i]->pos + alignments[i]->fragment_length - primer_length : -1;
+    entry.frac = &(alignments[i]->frac);
+  }
+
+  std::vector<InMemAlign*>().swap(alignments); // release the pointer vector
+}
+
+void PROBerTransModel::mergeSlices(int fr, int to, int nslices, double* const* p_starts, double* const* p_ends, double* const* p_end_ses) {
+  memcpy(start + fr, p_starts[0] + fr, sizeof(double) * (to - fr));
+  memcpy(end + fr, p_ends[0] + fr, sizeof(double) * (to - fr));
+  if (hasSE) memcpy(end_se + fr, p_end_ses[0] + fr, sizeof(double) * (to - fr));
+
+  for (int k = 1; k < nslices; ++k) {
+    for (int i = fr; i < to; ++i) {
+      start[i] += p_starts[k][i];
+      end[i] += p_ends[k][i];
     }
-    N_obs[channel] += alignments[i]->frac;
+    if (hasSE) 
+      for (int i = fr; i < to; ++i) end_se[i] += p_end_ses[k][i];
+  }
+}
+
+void PROBerTransModel::finishSlices(int nslices, double* const* p_sums) {
+  int channel = getChannel();
+
+  N_obs[channel] = N_se = 0.0;
+  for (int k = 0; k < nslices; ++k) {
+    N_obs[channel] += p_sums[k][0];
+    N_se += p_sums[k][1];
   }
 
   if (isZero(N_obs[channel])) N_obs[channel] = 0.0; // if N_obs is small, directly set it to 0
@@ -292,25 +396,25 @@ inline void PROBerTransModel::solveQuadratic2(double& gamma, double& beta, doubl
   assert(gamma > 0.0 && gamma < 1.0);
 }
 
-void PROBerTransModel::EM_step() {
-  int channel = getChannel();
-  double N_tot;
+template<int STATE, bool MAP>
+void PROBerTransModel::EM_step_kernel() {
+  const int CHANNEL = STATE & 1;
   
   int max_end_i;
-  double psum, value;
+  double value;
 
   assert(start2 != NULL && end2 != NULL);
 
   // What to do if no observed reads
-  if (isZero(N_obs[channel])) {
+  if (isZero(N_obs[CHANNEL])) {
     // force unobserved reads to zero
-    switch(getState()) {
+    switch(STATE) {
     case 0:
-      value = (isMAP ? dgamma / (cgamma + dgamma) : 0.0);
+      value = (MAP ? dgamma / (cgamma + dgamma) : 0.0);
       for (int i = 1; i <= len; ++i) gamma[i] = value;
       break;
     case 1:
-      value = (isMAP ? dbeta / (cbeta + dbeta) : 0.0);
+      value = (MAP ? dbeta / (cbeta + dbeta) : 0.0);
       for (int i = 1; i <= len; ++i) beta[i] = value;
       break;
     case 2:
@@ -318,7 +422,7 @@ void PROBerTransModel::EM_step() {
       memset(ccm, 0, sizeof(double) * (len + 1));
       break;
     case 3:
-      if (isMAP) {
+      if (MAP) {
 	value = dbeta / (cbeta + dbeta);
 	for (int i = 1; i <= len; ++i) {
 	  gamma[i] = (dgamma + dcm[i]) / (cgamma + ccm[i] + dgamma + dcm[i]); 
@@ -336,8 +440,6 @@ void PROBerTransModel::EM_step() {
     }
   }
   else {
-    //    N_tot = N_obs[channel] / prob_pass[channel]; 
-      
     //E step, if we have reads that do not know their start positions, infer start from end
     if (!isZero(N_se)) {
       double prev, curr;
@@ -361,58 +463,68 @@ void PROBerTransModel::EM_step() {
 	  if (value < 0.0) value = 0.0;
 	}
 	
-	curr += (channel == 0 ? (1.0 - gamma[pos]) : (1.0 - gamma[pos]) * (1.0 - beta[pos])) * value;
+	curr += passProb<CHANNEL>(pos) * value;
 	start[pos] += curr;
       }
     }
 
-    // E step, calculate hidden reads
-    // Calculate end2
-    /*
-
-    psum = 1.0;
-    for (int i = len; i >= 0; --i) {
-      if (i < efflen) end2[i] = std::max(psum - exp(logsum[i + min_frag_len] - logsum[i]) * margin_prob[i], 0.0);
-      else end2[i] = psum;
-      if (i > 0) end2[i] *= (channel == 0 ? gamma[i] : gamma[i] + beta[i] - gamma[i] * beta[i]);
-      end2[i] *= delta * N_tot;
-      if (i > 0) psum = 1.0 + psum * (channel == 0 ? (1.0 - gamma[i]) : (1.0 - gamma[i]) * (1.0 - beta[i]));
-    }
-    
-    // Calculate start2
-    for (int i = 0; i < min_frag_len; ++i) start2[i] = delta * N_tot;
-    psum = 1.0;
-    for (int i = min_frag_len, pos = 0; i <= len; ++i, ++pos) {
-      start2[i] = std::max(1.0 - psum * exp(logsum[i] - logsum[pos]), 0.0);
-      start2[i] *= delta * N_tot;
-      if (i < len) {
-	max_end_i = i - max_frag_len;
-	if (max_end_i >= 0) {
-	  value = exp(logsum[pos] - logsum[max_end_i]);
-	  if (max_end_i > 0) value *= (channel == 0 ? gamma[max_end_i] : gamma[max_end_i] + beta[max_end_i] - gamma[max_end_i] * beta[max_end_i]);
-	  psum = std::max(psum - value, 0.0);
-	}
-	psum = (channel == 0 ? psum * (1.0 - gamma[pos + 1]) + gamma[pos + 1]: psum * (1.0 - gamma[pos + 1]) * (1.0 - beta[pos + 1]) + (gamma[pos + 1] + beta[pos + 1] - gamma[pos + 1] * beta[pos + 1]));
-      }
-    }
-
-    */
-
-
     // M step
     double dc, cc; // dc: drop-off count; cc: covering count
+
+    // Values taken inside zero-coverage spans, except under MAP in state 1 where beta still depends on gamma[i]
+    const bool USE_ZERO_SPANS = !(STATE == 1 && MAP);
+    double span_gamma = 0.0, span_beta = 0.0;
+    if (STATE == 0 && MAP) span_gamma = dgamma / (dgamma + cgamma);
+    if (STATE == 3 && MAP) solveQuadratic2(span_gamma, span_beta, 0.0, 0.0, 0.0, 0.0);
     
     start2[0] = start[0]; end2[0] = end[0];
     for (int i = 1; i <= len; ++i) {
+      // Zero-coverage span [i, j): no fragment covers i and none starts or ends inside, so dc = cc = 0 over the whole span
+      if (USE_ZERO_SPANS && end2[i - 1] - start2[i - 1] <= 0.0 && end[i] == 0.0 && start[i] == 0.0) {
+	int j = i + 1;
+	while (j <= len && end[j] == 0.0 && start[j] == 0.0) ++j;
+	end2[j - 1] = end2[i - 1];
+	start2[j - 1] = start2[i - 1];
+
+	switch(STATE) {
+	case 0: 
+	  for (int k = i; k < j; ++k) gamma[k] = span_gamma; 
+	  break;
+	case 1: 
+	  memset(beta + i, 0, sizeof(double) * (j - i)); 
+	  break;
+	case 2:
+	  memset(dcm + i, 0, sizeof(double) * (j - i));
+	  memset(ccm + i, 0, sizeof(double) * (j - i));
+	  break;
+	case 3:
+	  for (int k = i; k < j; ++k) {
+	    if (MAP) {
+	      if (dcm[k] == 0.0 && ccm[k] == 0.0) { gamma[k] = span_gamma; beta[k] = span_beta; }
+	      else solveQuadratic2(gamma[k], beta[k], dcm[k], ccm[k], 0.0, 0.0);
+	    }
+	    else {
+	      gamma[k] = (dcm[k] > 0.0 ? dcm[k] / (dcm[k] + ccm[k]) : 0.0);
+	      beta[k] = 0.0;
+	    }
+	  }
+	  break;
+	default: assert(false);
+	}
+
+	i = j - 1;
+	continue;
+      }
+
       dc = std::max(0.0, end[i]); // drop-off count
       cc = std::max(0.0, end2[i - 1] - start2[i - 1]); // covering count
       end2[i] = end2[i - 1] + end[i];
       start2[i] = start2[i - 1] + start[i];
       
-      switch(getState()) {
+      switch(STATE) {
       case 0: 
 	// learn separately, (-) channel 
-	if (isMAP) {
+	if (MAP) {
 	  gamma[i] = (dgamma + dc) / (dgamma + dc + cgamma + cc);
 	  assert(gamma[i] > 0.0 && gamma[i] < 1.0);
 	}
@@ -422,7 +534,7 @@ void PROBerTransModel::EM_step() {
 	break;
       case 1:
 	// learn separately, (+) channel
-	if (isMAP) {
+	if (MAP) {
 	  solveQuadratic1(beta[i], gamma[i], dc, cc);
 	}
 	else {
@@ -436,7 +548,7 @@ void PROBerTransModel::EM_step() {
 	ccm[i] = cc;
 	break;
       case 3:
-	if (isMAP) {
+	if (MAP) {
      	  solveQuadratic2(gamma[i], beta[i], dcm[i], ccm[i], dc, cc);
 	}
 	else {
@@ -459,7 +571,23 @@ void PROBerTransModel::EM_step() {
   }
 
   // Prepare for the next round
-  calcAuxiliaryArrays(isJoint()? channel ^ 1 : channel);
+  (this->*calcAuxFuncs[STATE >= 2 ? CHANNEL ^ 1 : CHANNEL])();
+}
+
+void PROBerTransModel::EM_step(double* prev) {
+  // state 0 updates gamma, state 1 beta, state 2 only records counts and state 3 updates both
+  double *arrays[2] = { (state == 0 || state == 3) ? gamma : NULL, (state == 1 || state == 3) ? beta : NULL };
+
+  for (int k = 0; k < 2; ++k) 
+    if (arrays[k] != NULL) memcpy(prev + k * len, arrays[k] + 1, sizeof(double) * len);
+
+  EM_step();
+
+  param_change = 0.0;
+  for (int k = 0; k < 2; ++k) 
+    if (arrays[k] != NULL) 
+      for (int i = 0; i < len; ++i) 
+	param_change = std::max(param_change, fabs(arrays[k][i + 1] - prev[k * len + i]));
 }
 
 void PROBerTransModel::read(std::ifstream& fin, int channel) {
@@ -467,7 +595,18 @@ void PROBerTransModel::read(std::ifstream& fin, int channel) {
   int tmp_len;
 
   fin>> tmp_name>> tmp_len;
+  setNameAndLength(tmp_name, tmp_len);
+
+  double *values = allocateChannel(channel);
+  for (int i = 1; i <= len; ++i) fin>> values[i];
+}
+
+void PROBerTransModel::read(const char* tname, int tlen, const double* values, int channel) {
+  setNameAndLength(tname, tlen);
+  memcpy(allocateChannel(channel) + 1, values, sizeof(double) * len);
+}
 
+void PROBerTransModel::setNameAndLength(const std::string& tmp_name, int tmp_len) {
   if (name == "") { 
     name = tmp_name; len = tmp_len;
     efflen = len - min_frag_len + 1;
@@ -479,36 +618,47 @@ void PROBerTransModel::read(std::ifstream& fin, int channel) {
     }
   }
   else assert((tmp_name == name) && (tmp_len == len));
+}
 
-  if (channel == 0) {
-    if (gamma == NULL) gamma = new double[len + 1];
-    gamma[0] = 0.0;
-    for (int i = 1; i <= len; ++i) fin>> gamma[i];
-  }
-  else {
-    if (beta == NULL) beta = new double[len + 1];
-    beta[0] = 0.0;
-    for (int i = 1; i <= len; ++i) fin>> beta[i];
-  }
+double* PROBerTransModel::allocateChannel(int channel) {
+  double *&values = (channel == 0 ? gamma : beta);
+  if (values == NULL) values = new double[len + 1];
+  values[0] = 0.0;
+  return values;
+}
+
+void PROBerTransModel::warmStart(std::ifstream& fin, int channel) {
+  double *values = (channel == 0 ? gamma : beta);
+
+  assert(values != NULL);
+  for (int i = 1; i <= len; ++i) assert(fin>> values[i]);
+}
+
+void PROBerTransModel::warmStart(const double* values, int channel) {
+  double *params = (channel == 0 ? gamma : beta);
+
+  assert(params != NULL);
+  memcpy(params + 1, values, sizeof(double) * len);
 }
 
 void PROBerTransModel::write(std::ofstream& fout, int channel) {
+  const double *values = getOutputArray(channel);
+
   fout<< name<< '\t'<< len;
+  for (int i = 0; i < len; ++i) fout<< '\t'<< values[i];
+  fout<< std::endl;
+}
 
+const double* PROBerTransModel::getOutputArray(int channel) {
   if (channel == 0) {
-
     // If MAP estimate, separately learn and the transcript is excluded, set the gammas to gamma_init 
     if (isMAP && getState() == 0 && isExcluded()) {
       for (int i = 1; i <= len; ++i) gamma[i] = gamma_init;
     }
-
-    for (int i = 1; i <= len; ++i) fout<< '\t'<< gamma[i];
-  }
-  else {
-    for (int i = 1; i <= len; ++i) fout<< '\t'<< beta[i];
+    return gamma + 1;
   }
 
-  fout<< std::endl;
+  return beta + 1;
 }
 
 void PROBerTransModel::writeFreq(std::ofstream& fc, std::ofstream& fout) {
@@ -11,6 +11,7 @@
 #include "utils.h"
 #include "sampling.hpp"
 #include "InMemoryStructs.hpp"
+#include "SlabArena.hpp"
 
 /*
   The coordinate system used outside is 0-based, starting from 5' end.
@@ -25,8 +26,16 @@ public:
     @param   tid     transcript id (internal use)
     @param   name    transcript name
     @param   transcript_length  the length of this transcript
+    @param   arena   if not NULL, gamma and beta are carved from arena, which must have been prepared by reserveParams
    */
-  PROBerTransModel(int tid, const std::string& name = "", int transcript_length = -1);
+  PROBerTransModel(int tid, const std::string& name = "", int transcript_length = -1, SlabArena* arena = NULL);
+
+  /*
+    @param   arena               the arena to reserve space in
+    @param   transcript_length   the length of a transcript to be created with arena
+    @comment: reserve space for the gamma and beta arrays of a learning transcript, call after setGlobalParams
+   */
+  static void reserveParams(SlabArena* arena, int transcript_length);
 
   ~PROBerTransModel();
 
@@ -94,7 +103,7 @@ public:
   /*
     @comment: change channel
    */
-  static void flipState() { state = state ^ 1; }
+  static void flipState() { state = state ^ 1; selectKernels(); }
 
   /*
     @return   which channel we are dealing with (0, -; 1, +)
@@ -131,14 +140,27 @@ public:
     @return   number of alignments this transcript has for channel
   */
   HIT_INT_TYPE getNumAlignments(int channel) const {
-    return alignmentsArr[channel].size();
+    return numAligns[channel];
+  }
+
+  /*
+    @param   channel   which channel to look at
+    @return   number of alignments in the alignment index for channel, smaller than getNumAlignments(channel) once alignments are pruned
+  */
+  HIT_INT_TYPE getNumIndexed(int channel) const {
+    return numIndexed[channel];
   }
 
+  /*
+    @return   true if this transcript has SE reads from either channel, i.e. end_se is used
+   */
+  bool hasSEReads() const { return hasSE; }
+
   /*
     @comment: check if this transcript can be excluded from learning procedure due to either no available position or no alignments. Must call after alignments are processed!
   */
   bool isExcluded() const {
-    return efflen <= 0 || (!isJoint() && alignmentsArr[getChannel()].size() == 0) || (isJoint() && alignmentsArr[0].size() == 0 && alignmentsArr[1].size() == 0);
+    return efflen <= 0 || (!isJoint() && numAligns[getChannel()] == 0) || (isJoint() && numAligns[0] == 0 && numAligns[1] == 0);
   }
 
   /*
@@ -166,7 +188,7 @@ public:
     int start_pos = pos + min_alloc_len;
     if (start_pos > len || pos < 0) return 0.0;
     double res = delta * (min_alloc_len == min_frag_len ? margin_prob[pos] : margin_prob2[pos]) * exp(logsum[start_pos] - logsum[pos]);
-    if (pos > 0) res *= (getChannel() == 0 ? gamma[pos] : (gamma[pos] + beta[pos] - gamma[pos] * beta[pos]));
+    if (pos > 0) res *= (getChannel() == 0 ? dropProb<0>(pos) : dropProb<1>(pos));
 
     return res;
   }
@@ -183,7 +205,7 @@ public:
     if (start_pos > len || pos < 0) return 0.0;
     
     double res = delta * exp(logsum[start_pos] - logsum[pos]);
-    if (pos > 0) res *= (getChannel() == 0 ? gamma[pos] : (gamma[pos] + beta[pos] - gamma[pos] * beta[pos]));
+    if (pos > 0) res *= (getChannel() == 0 ? dropProb<0>(pos) : dropProb<1>(pos));
 
     return res;
   }
@@ -220,29 +242,108 @@ public:
     }
 
     alignmentsArr[getChannel()].push_back(alignment);
+    ++numAligns[getChannel()];
 
     return true;
   }
 
+  /*
+    @param   channel   which channel's alignments to index
+    @comment: Turn the alignments added for channel into a flat array sorted by position (a counting sort, stable in read order) and release the pointer vector. Call after all alignments are added and before the first update.
+   */
+  void buildAlignmentIndex(int channel);
+
+  /*
+    @param   channel   which channel's alignment index to drop
+    @comment: Drop the index before the alignments it points to are moved, then re-add the alignments that are kept with readdAlignment() and call buildAlignmentIndex() again.
+              getNumAlignments() still reports the alignments added during preprocessing, so that no transcript becomes excluded.
+   */
+  void clearAlignmentIndex(int channel) {
+    if (alignIndex[channel] != NULL) { delete[] alignIndex[channel]; alignIndex[channel] = NULL; }
+    numIndexed[channel] = 0;
+  }
+
+  /*
+    @param   alignment   an alignment accepted by addAlignment() before, at its new address
+    @param   channel     the alignment's channel
+   */
+  void readdAlignment(InMemAlign* alignment, int channel) {
+    alignmentsArr[channel].push_back(alignment);
+  }
+
+  /*
+    @param   channel   which channel's alignments to release
+    @comment: Release the pointer vector without building the index, used when counts are accumulated during the E step instead of by update()
+   */
+  void releaseAlignments(int channel) {
+    std::vector<InMemAlign*>().swap(alignmentsArr[channel]);
+  }
+
   /*
     @comment: Initialize related data members to prepare this transcript for parameter esitmation. Call only after all alignments are added.
    */
-  void init();
+  void init(SlabArena* arena = NULL);
+
+  /*
+    @param   arena   the arena to reserve space in
+    @comment: reserve space for the arrays init() allocates, so that init(arena) can carve them from the arena. Call after alignments are added.
+   */
+  void reserveArrays(SlabArena* arena) const;
 
   /*
     @param   channel   which channel we should calculate for
     @comment: This function calculate logsum and margin_prob and prob_pass, which are used to speed up the calculation
     @comment: It should be called before EM or getProb or get ProbPass etc. 
    */
-  void calcAuxiliaryArrays(int channel);
+  void calcAuxiliaryArrays(int channel) { (this->*calcAuxFuncs[channel])(); }
 
   // Update counts information at each position
   void update();
 
+  /*
+    @param   fr       the first alignment of the slice
+    @param   to       one past the last alignment of the slice
+    @param   p_start  partial start counts, len + 1 entries, zeroed by this function
+    @param   p_end    partial end counts, len + 1 entries, zeroed by this function
+    @param   p_end_se partial SE end counts, len + 1 entries, zeroed by this function if hasSE
+    @param   p_sums   p_sums[0], partial N_obs; p_sums[1], partial N_se
+    @comment: Scatter alignments [fr, to) of the current channel into thread private arrays. Used when several threads share the update of one highly covered transcript.
+   */
+  void updateSlice(HIT_INT_TYPE fr, HIT_INT_TYPE to, double* p_start, double* p_end, double* p_end_se, double* p_sums);
+
+  /*
+    @param   fr        the first position to merge
+    @param   to        one past the last position to merge
+    @param   nslices   number of slices
+    @param   p_starts  partial start counts of each slice
+    @param   p_ends    partial end counts of each slice
+    @param   p_end_ses partial SE end counts of each slice
+    @comment: Sum the slices' partial counts at positions [fr, to) into start, end and end_se
+   */
+  void mergeSlices(int fr, int to, int nslices, double* const* p_starts, double* const* p_ends, double* const* p_end_ses);
+
+  /*
+    @param   nslices   number of slices
+    @param   p_sums    partial sums of each slice
+    @comment: Set N_obs and N_se from the slices' partial sums, call after all slices are merged
+   */
+  void finishSlices(int nslices, double* const* p_sums);
+
   /*
     @comment: Run one iteration of EM algorithm for a single transcript
    */
-  void EM_step();
+  void EM_step() { (this->*emStepFunc)(); }
+
+  /*
+    @param   prev   scratch space of at least 2 * len doubles
+    @comment: Run EM_step() and record the largest absolute change of the gamma/beta values it updates, see getParamChange()
+   */
+  void EM_step(double* prev);
+
+  /*
+    @return  the largest absolute change of gamma/beta in the last EM_step(prev) call
+   */
+  double getParamChange() const { return param_change; }
 
   /*
     @param   fin   input stream
@@ -251,6 +352,28 @@ public:
    */
   void read(std::ifstream& fin, int channel);
 
+  /*
+    @param   tname     transcript name
+    @param   tlen      transcript length, the same as in a gamma/beta file
+    @param   values    tlen values for positions 1 .. tlen, e.g. mapped from a ParamStore
+    @param   channel   which channel
+   */
+  void read(const char* tname, int tlen, const double* values, int channel);
+
+  /*
+    @param   fin       input stream positioned right after this transcript's name and length in a gamma/beta file
+    @param   channel   0, load gamma; 1, load beta
+    @comment: Load the values estimated by a previous run as the starting point of EM, call after init()
+   */
+  void warmStart(std::ifstream& fin, int channel);
+
+  /*
+    @param   values    len values for positions 1 .. len, e.g. mapped from a ParamStore
+    @param   channel   0, load gamma; 1, load beta
+    @comment: the same as above, but from memory
+   */
+  void warmStart(const double* values, int channel);
+
   /*
     @param   fout     output stream
     @param   channel  which channel 
@@ -258,6 +381,12 @@ public:
    */
   void write(std::ofstream& fout, int channel);
 
+  /*
+    @param   channel  which channel
+    @return  the len values write() outputs for this channel, positions 1 .. len
+   */
+  const double* getOutputArray(int channel);
+
   /*
     @param   fc   output stream for c, the marking rate
     @param   fout output stream for freqs
@@ -311,6 +440,7 @@ private:
   double delta; // probability of priming from a particular position, delta = 1.0 / (len + 1)
   double N_obs[2]; // Total number of observed counts
   double prob_pass[2]; // probability of generating a read that passes the size selection step
+  double param_change; // see getParamChange()
   double *gamma, *beta; // gamma, the vector of probability of drop-off at i (1-based); beta, the vector of probability of demtheylation at position i (1-based); 
   double *start, *end; // start, number of reads with first base after primer starting at a position; end, number of reads whose TF drops off at a position
   double *dcm, *ccm; // drop-off counts and covering counts for (-) channel
@@ -332,9 +462,61 @@ private:
 
   double log_prior[2]; // log prior of a transcript, lgamma function parts are excldued
 
+  bool paramsInArena, arraysInArena; // if gamma/beta and the arrays allocated in init() come from a SlabArena, which releases them
+
   double *cdf_end; // cumulative probabilities of having a read end at a particular position, only used for simulation
 
-  std::vector<InMemAlign*> alignmentsArr[2]; // In memory alignments used for update from (-) and (+) channels
+  std::vector<InMemAlign*> alignmentsArr[2]; // In memory alignments from (-) and (+) channels, only kept until buildAlignmentIndex is called
+  HIT_INT_TYPE numAligns[2]; // number of alignments from (-) and (+) channels
+  HIT_INT_TYPE numIndexed[2]; // number of entries in alignIndex
+  InMemAlignIdx *alignIndex[2]; // alignment index used for update from (-) and (+) channels, sorted by pos
+
+  /*
+    comment: Kernels below are specialized at compile time on state, channel and isMAP, so that their per-position loops are branch free.
+             The kernels matching the current state are looked up once per phase by selectKernels().
+   */
+  typedef void (PROBerTransModel::*EMStepFunc)();
+  typedef void (PROBerTransModel::*CalcAuxFunc)();
+
+  static EMStepFunc emStepFunc; // EM_step kernel for the current state
+  static CalcAuxFunc calcAuxFuncs[2]; // calcAuxiliaryArrays kernels for (-) and (+) channels
+
+  /*
+    @comment: pick the kernels matching the current state and isMAP, called whenever either one changes
+   */
+  static void selectKernels();
+
+  /*
+    @param   tmp_name   transcript name read from a gamma/beta file or a ParamStore
+    @param   tmp_len    transcript length read alongside
+    @comment: set name and length and allocate the auxiliary arrays on first read, otherwise check that they match
+   */
+  void setNameAndLength(const std::string& tmp_name, int tmp_len);
+
+  /*
+    @param   channel   0, gamma; 1, beta
+    @return  the array of this channel, allocated if necessary, with position 0 set to 0
+   */
+  double* allocateChannel(int channel);
+
+  template<int STATE, bool MAP> void EM_step_kernel();
+  template<int CHANNEL, bool MAP> void calcAuxiliaryArrays_kernel();
+
+  /*
+    @param   pos   position, 1-based
+    @return  the probability that the TF drops off at pos in channel CHANNEL
+   */
+  template<int CHANNEL> double dropProb(int pos) const {
+    return CHANNEL == 0 ? gamma[pos] : gamma[pos] + beta[pos] - gamma[pos] * beta[pos];
+  }
+
+  /*
+    @param   pos   position, 1-based
+    @return  the probability that the TF passes pos without dropping off in channel CHANNEL
+   */
+  template<int CHANNEL> double passProb(int pos) const {
+    return CHANNEL == 0 ? 1.0 - gamma[pos] : (1.0 - gamma[pos]) * (1.0 - beta[pos]);
+  }
 
   /*
     @param   beta   beta value at a position, this is the to-be-estimated parameter
@@ -80,7 +80,7 @@ PROBerTransModelS::PROBerTransModelS(int tid, const std::string& name, int trans
 
   delta = 0.0;
 
-  hasSE = false;
+  hasSE[0] = hasSE[1] = false;
 
   N_se[0] = N_se[1] = 0.0;
   for (int i = 0; i < 2; ++i) {
@@ -182,7 +182,7 @@ void PROBerTransModelS::init() {
     memset(ccm, 0, sizeof(double) * (len + 1));
   }
   
-  if (hasSE) {
+  if (hasSE[0] || hasSE[1]) {
     end_se = new double[len + 1];
     memset(end_se, 0, sizeof(double) * (len + 1));
 
@@ -490,6 +490,111 @@ void PROBerTransModelS::EM_step(double N_tot) {
   calcAuxiliaryArrays(isJoint()? channel ^ 1 : channel);
 }
 
+double PROBerTransModelS::EM_round(const double* Nobs) {
+  double logprob = log_prob[0];
+
+  assert(getChannel() == 0);
+  EM_step(Nobs[0] / prob_pass[0]);
+  flipState();
+  logprob += log_prob[1]; // calculated by the (-) channel's EM_step, which does not change gamma and beta
+  EM_step(Nobs[1] / prob_pass[1]);
+  flipState();
+
+  return logprob;
+}
+
+double PROBerTransModelS::calcLogProb() {
+  calcAuxiliaryArrays(1);
+  calcAuxiliaryArrays(0);
+  return log_prob[0] + log_prob[1];
+}
+
+void PROBerTransModelS::getLogits(double* x, std::vector<char>& interior) const {
+  for (int i = 1; i <= len; ++i) {
+    if (gamma[i] > 0.0 && gamma[i] < 1.0) x[i - 1] = log(gamma[i]) - log(1.0 - gamma[i]);
+    else { x[i - 1] = 0.0; interior[i - 1] = 0; }
+    if (beta[i] > 0.0 && beta[i] < 1.0) x[len + i - 1] = log(beta[i]) - log(1.0 - beta[i]);
+    else { x[len + i - 1] = 0.0; interior[len + i - 1] = 0; }
+  }
+}
+
+void PROBerTransModelS::setLogits(const double* x, const std::vector<char>& interior) {
+  const double BOUND = 30.0; // keep parameters away from 0 and 1
+  for (int i = 1; i <= len; ++i) {
+    if (interior[i - 1]) gamma[i] = 1.0 / (1.0 + exp(-std::max(-BOUND, std::min(BOUND, x[i - 1]))));
+    if (interior[len + i - 1]) beta[i] = 1.0 / (1.0 + exp(-std::max(-BOUND, std::min(BOUND, x[len + i - 1]))));
+  }
+}
+
+int PROBerTransModelS::runEM(const double* Nobs, int max_round, double deltaChange, bool accelerate) {
+  double N = Nobs[0] + Nobs[1];
+  double prev_logprob, curr_logprob;
+  int ROUND;
+
+  init();
+  assert(getState() == 2);
+  calcAuxiliaryArrays(0);
+
+  if (!accelerate) {
+    prev_logprob = -1e300;
+    for (ROUND = 1; ROUND <= max_round; ++ROUND) {
+      curr_logprob = EM_round(Nobs);
+      if ((curr_logprob - prev_logprob) / N <= deltaChange) break;
+      prev_logprob = curr_logprob;
+    }
+    return std::min(ROUND, max_round);
+  }
+
+  // SQUAREM (Varadhan and Roland, 2008), scheme S3, with x0 -> x1 -> x2 two EM rounds
+  int size = 2 * len;
+  std::vector<double> x0(size), x1(size), x2(size), xs(size), p2(size);
+  std::vector<char> interior(size); // parameters strictly inside (0, 1) at x0, x1 and x2, only these are extrapolated
+  double logprob0, logprob1, logprob2, logprobs;
+  double sr, sv, alpha;
+
+  ROUND = 0;
+  while (ROUND < max_round) {
+    interior.assign(size, 1);
+    getLogits(&x0[0], interior);
+    logprob0 = EM_round(Nobs); ++ROUND;
+    getLogits(&x1[0], interior);
+    logprob1 = EM_round(Nobs); ++ROUND;
+    if ((logprob1 - logprob0) / N <= deltaChange || ROUND >= max_round) break;
+    getLogits(&x2[0], interior);
+
+    sr = sv = 0.0;
+    for (int i = 0; i < size; ++i) if (interior[i]) {
+      double r = x1[i] - x0[i], v = x2[i] - x1[i] - r;
+      sr += r * r; sv += v * v;
+    }
+    // interior logits are finite, so are sr and sv; plain comparisons, -ffast-math folds isfinite/isnan away
+    if (sv <= 0.0 || sr >= sv * 1e300) continue;
+    alpha = -sqrt(sr / sv);
+    if (alpha > -1.0) continue; // alpha = -1 gives x2 itself
+
+    for (int i = 0; i < size; ++i) if (interior[i]) {
+      double r = x1[i] - x0[i], v = x2[i] - x1[i] - r;
+      xs[i] = x0[i] - 2.0 * alpha * r + alpha * alpha * v;
+    }
+
+    // keep x2 itself, its logits may not convert back exactly
+    memcpy(&p2[0], gamma + 1, sizeof(double) * len);
+    memcpy(&p2[len], beta + 1, sizeof(double) * len);
+    logprob2 = calcLogProb();
+
+    // parameters at the boundary keep their x2 values
+    setLogits(&xs[0], interior);
+    logprobs = calcLogProb();
+    if (logprobs < logprob2) {
+      memcpy(gamma + 1, &p2[0], sizeof(double) * len);
+      memcpy(beta + 1, &p2[len], sizeof(double) * len);
+      calcAuxiliaryArrays(0);
+    }
+  }
+
+  return ROUND;
+}
+
 void PROBerTransModelS::read(std::ifstream& fin, int channel) {
   std::string tmp_name;
   int tmp_len;
@@ -520,7 +625,7 @@ void PROBerTransModelS::read(std::ifstream& fin, int channel) {
   }
 }
 
-void PROBerTransModelS::write(std::ofstream& fout, int channel) {
+void PROBerTransModelS::write(std::ostream& fout, int channel) {
   fout<< name<< '\t'<< len;
 
   if (channel == 0) {
@@ -159,13 +159,20 @@ public:
     @return   true if the alignment is added, false otherwise
     @comment:  if the alignment's fragment length is not in [min_frag_len, max_frag_len] range, reject it
    */
-  bool addAlignment(InMemAlign* alignment) {
+  bool addAlignment(InMemAlign* alignment) { return addAlignment(alignment, getChannel()); }
+
+  /*
+    @param   alignment   an in memory alignment belong to this transcript
+    @param   channel     the channel the alignment comes from
+    @return   true if the alignment is added, false otherwise
+    @comment:  same as above, but alignments of the two channels only touch their own channel's data, so they can be added from two threads concurrently
+   */
+  bool addAlignment(InMemAlign* alignment, int channel) {
     int frag_len = alignment->fragment_length;
-    int channel = getChannel();
 
     if (frag_len == 0) { // SE reads
       if (alignment->pos + min_alloc_len > len) return false;
-      hasSE = true; // we have at least one SE read
+      hasSE[channel] = true; // we have at least one SE read
       ends[channel][alignment->pos] += alignment->frac;
       ends_se[channel][alignment->pos] += alignment->frac;
       N_se[channel] += alignment->frac;
@@ -200,6 +207,18 @@ public:
    */
   void EM_step(double N_tot);
 
+  /*
+    @param   Nobs          expected observed reads of the (-) and (+) channels
+    @param   max_round     maximum number of EM rounds
+    @param   deltaChange   stop once a round improves the log probability by no more than deltaChange per read
+    @param   accelerate    if true, extrapolate every two rounds with SQUAREM
+    @return  number of EM rounds run
+    @comment: Initialize and run joint EM to convergence, call only after all alignments are added.
+              SQUAREM extrapolates gamma and beta in logit space and keeps the extrapolated point only if its log probability is no smaller than
+              that of the plain EM point, so the log probability never decreases.
+   */
+  int runEM(const double* Nobs, int max_round, double deltaChange, bool accelerate = false);
+
   /*
     @param   fin   input stream
     @param   channel   which channel
@@ -212,7 +231,7 @@ public:
     @param   channel  which channel 
     @format: the same as read
    */
-  void write(std::ofstream& fout, int channel);
+  void write(std::ostream& fout, int channel);
 
   /*
     @param   fc   output stream for c, the marking rate
@@ -273,7 +292,7 @@ private:
   double *dcm, *ccm; // drop-off counts and covering counts for (-) channel
   double *end_se; // number of SE reads end at a position
 
-  bool hasSE; // if this transcript has SE reads, which means we do not know its start, from either of the channels
+  bool hasSE[2]; // if this transcript has SE reads from the (-)/(+) channel, which means we do not know their starts
 
   /*
     comment: Auxiliary arrays below
@@ -312,6 +331,26 @@ private:
     @param   ccp     covering counts at (+) channel
    */
   void solveQuadratic2(double& gamma, double& beta, double dcm, double ccm, double dcp, double ccp);
+
+  /*
+    @param   Nobs   expected observed reads of the (-) and (+) channels
+    @return  log probability of the parameters before the update
+    @comment: one joint EM round, call with auxiliary arrays calculated for the (-) channel
+   */
+  double EM_round(const double* Nobs);
+
+  /*
+    @return  log probability of the current parameters, leaves the auxiliary arrays calculated for the (-) channel
+   */
+  double calcLogProb();
+
+  /*
+    @param   x         gamma and beta in logit space, gamma at [0, len) and beta at [len, 2 * len)
+    @param   interior  same layout, cleared for parameters at 0 or 1 (maximum likelihood estimates can be), whose logits are not finite
+    @comment: setLogits only sets parameters still marked in interior, the others keep their current values
+   */
+  void getLogits(double* x, std::vector<char>& interior) const;
+  void setLogits(const double* x, const std::vector<char>& interior);
 };
 
 #endif
@@ -2,8 +2,13 @@
 #include<cstring>
 #include<cassert>
 #include<string>
+#include<map>
 #include<vector>
+#include<utility>
+#include<algorithm>
 #include<fstream>
+#include<fcntl.h>
+#include<unistd.h>
 #include<pthread.h>
 
 #include "utils.h"
@@ -13,6 +18,8 @@
 #include "MyHeap.hpp"
 #include "PROBerWholeModel.hpp"
 
+const double PROBerWholeModel::THETA_CHANGE_FLOOR = 1e-7;
+
 PROBerWholeModel::PROBerWholeModel(const char* config_file, int init_state, bool has_control, const Transcripts* trans, int num_threads, int read_length, bool isMAP) {
   // set PROBerTransModel static member values
   int primer_length, min_frag_len, max_frag_len;
@@ -47,7 +54,9 @@ PROBerWholeModel::PROBerWholeModel(const char* config_file, int init_state, bool
     prob_noise[i][0] = prob_noise[i][1] = 0.0;
     prob_pass[i] = 0.0;
     paramsVecUp[i].clear();
+    splitTrans[i].clear();
   }
+  paramsVecSlice.clear();
 
   consts[0] = consts[1] = 0.0;
   logprior[0] = logprior[1] = 0.0;
@@ -57,6 +66,17 @@ PROBerWholeModel::PROBerWholeModel(const char* config_file, int init_state, bool
 
   channel_to_calc = -1;
 
+  paramArena = NULL;
+
+  tracking = false;
+  theta_change = gamma_beta_change = 0.0;
+
+  fused = false;
+  shards.clear();
+  shardArenas.clear();
+  shardOffsets.clear();
+  shardSize = 0;
+
   if (trans != NULL) {
     assert(num_threads >= 1);
     this->num_threads = num_threads;
@@ -66,9 +86,15 @@ PROBerWholeModel::PROBerWholeModel(const char* config_file, int init_state, bool
     M = trans->getM();
     theta.assign(M + 1, 0.0);
     transcripts.assign(M + 1, NULL);
+
+    // gamma and beta of all transcripts share one slab
+    paramArena = new SlabArena();
+    for (int i = 1; i <= M; ++i) PROBerTransModel::reserveParams(paramArena, trans->getTranscriptAt(i).getLength());
+    paramArena->allocate();
+
     for (int i = 1; i <= M; ++i) {
       const Transcript& tran = trans->getTranscriptAt(i);
-      transcripts[i] = new PROBerTransModel(i, tran.getTranscriptID(), tran.getLength());
+      transcripts[i] = new PROBerTransModel(i, tran.getTranscriptID(), tran.getLength(), paramArena);
       totlen += transcripts[i]->getLen();
     }
 
@@ -109,6 +135,12 @@ PROBerWholeModel::~PROBerWholeModel() {
     for (int j = 0; j < (int)paramsVecUp[i].size(); ++j) delete paramsVecUp[i][j];
 
   for (int i = 0; i < (int)paramsVecEM.size(); ++i) delete paramsVecEM[i];
+
+  for (int i = 0; i < (int)paramsVecSlice.size(); ++i) delete paramsVecSlice[i];
+
+  for (int i = 0; i < (int)shardArenas.size(); ++i) delete shardArenas[i];
+
+  if (paramArena != NULL) delete paramArena;
 }
 
 void PROBerWholeModel::init() {
@@ -147,6 +179,8 @@ void PROBerWholeModel::init() {
     for (int i = 1; i <= M; ++i) 
       if (!transcripts[i]->isExcluded()) theta[i] = 1.0 / total;
 
+    if (!warm_sample.empty()) loadWarmStart(state);
+
     // run init for each transcript
     int size = paramsVecEM.size();
     channel_to_calc = channel;
@@ -201,6 +235,16 @@ void PROBerWholeModel::EM_step(double count0) {
     pthread_assert(rc, "pthread_join", "Cannot join thread " + itos(i) + "(numbered from 0) for run_EM_step_per_thread at " + cstrtos(get_channel_string(channel)) + " channel!");
   }
 
+  advanceSchedule(schedEM, paramsVecEM);
+
+  double last_noise = prob_noise[channel][0];
+  if (tracking) {
+    gamma_beta_change = 0.0;
+    if (state != 2) 
+      for (int i = 1; i <= M; ++i) gamma_beta_change = std::max(gamma_beta_change, transcripts[i]->getParamChange());
+    last_theta = theta;
+  }
+
   // Estimate new theta and prob_noise
   sum = sum2 = 0.0;  
   for (int i = 1; i <= M; ++i) {
@@ -219,6 +263,13 @@ void PROBerWholeModel::EM_step(double count0) {
     for (int i = 1; i <= M; ++i) theta[i] /= sum2;
   }
 
+  if (tracking) {
+    theta_change = 0.0;
+    if (prob_noise[channel][0] >= THETA_CHANGE_FLOOR) theta_change = fabs(prob_noise[channel][0] - last_noise) / prob_noise[channel][0];
+    for (int i = 1; i <= M; ++i) 
+      if (theta[i] >= THETA_CHANGE_FLOOR) theta_change = std::max(theta_change, fabs(theta[i] - last_theta[i]) / theta[i]);
+  }
+
   // calculate the probability of a read passing size selection step for next call
   channel_to_calc = (state >= 2 ? (channel ^ 1) : channel); 
   calcProbPass(channel_to_calc);
@@ -256,6 +307,14 @@ void PROBerWholeModel::read(const char* input_name, const char* statName) {
 
   int tmp_M;
 
+  sprintf(input_param, "%s.params", input_name);
+  if (ParamStore::isParamStore(input_param)) {
+    ParamStore store(input_param);
+    readParamStore(store, state, learning);
+    if (verbose) printf("PROBerWholeModel::read is finished!\n");
+    return;
+  }
+
   // load gamma
   if (!learning || (learning && state == 1)) {
     sprintf(input_param, "%s.%s", input_name, (state == 0 && !has_control) ? "beta" : "gamma");
@@ -303,6 +362,140 @@ void PROBerWholeModel::read(const char* input_name, const char* statName) {
   if (verbose) printf("PROBerWholeModel::read is finished!\n");
 }
 
+void PROBerWholeModel::readParamStore(const ParamStore& store, int state, bool learning) {
+  general_assert(store.hasControl() == has_control, "The parameter store was " + cstrtos(has_control ? "not " : "") + "learned with a control!");
+
+  // load gamma
+  if (!learning || (learning && state == 1)) {
+    assert(store.hasArray(0));
+    if (!learning) {
+      M = store.getM();
+      theta.assign(M + 1, 0.0);
+      transcripts.assign(M + 1, NULL);
+      for (int i = 1; i <= M; ++i) transcripts[i] = new PROBerTransModel(i);
+    }
+    else assert(M == store.getM());
+
+    for (int i = 1; i <= M; ++i) transcripts[i]->read(store.getName(i), store.getLen(i), store.getArray(i, 0), 0);
+  }
+
+  // load beta
+  if (!learning && state == 1) {
+    assert(store.hasArray(1) && store.getM() == M);
+    for (int i = 1; i <= M; ++i) transcripts[i]->read(store.getName(i), store.getLen(i), store.getArray(i, 1), 1);
+  }
+
+  // load theta
+  if (!learning) {
+    assert(store.hasTheta(state & 1));
+    const double *values = store.getTheta(state & 1);
+    for (int i = 0; i <= M; ++i) theta[i] = values[i];
+  }
+}
+
+void PROBerWholeModel::loadWarmStart(int state) {
+  char paramF[STRLEN], thetaF[STRLEN];
+  std::ifstream fin;
+  std::string name, line;
+  int prev_M, len, tid, nchannels;
+  std::map<std::string, int> name2tid;
+  std::map<std::string, int>::iterator iter;
+  std::vector<double> prev_values; // prev_values[i], theta of the ith transcript of the previous run
+  std::vector<int> prev2tid; // prev2tid[i], current tid of the ith transcript of the previous run, 0 if it is gone, changed, excluded or was not estimated
+
+  assert(state == 0 || state == 2);
+  nchannels = (state == 2 ? 2 : 1);
+
+  for (int i = 1; i <= M; ++i) name2tid[transcripts[i]->getName()] = i;
+
+  // the previous run may have written a parameter store instead of text files
+  sprintf(paramF, "%s.params", warm_sample.c_str());
+  ParamStore *store = ParamStore::isParamStore(paramF) ? new ParamStore(paramF) : NULL;
+
+  // load theta and prob_noise first, a transcript with zero theta was not estimated (e.g. excluded) and its gamma/beta are not usable
+  double noise, value, sum = 0.0;
+  int nmatched = 0, ntotal = 0;
+
+  for (int channel = 0; channel < nchannels; ++channel) {
+    if (store != NULL) {
+      const double *values = store->getTheta(channel);
+      noise = values[0];
+      if (noise > 0.0 && noise < 1.0) {
+	prob_noise[channel][0] = noise;
+	prob_noise[channel][1] = 1.0 - noise;
+      }
+      if (channel == 0) prev_values.assign(values, values + store->getM() + 1);
+      continue;
+    }
+
+    sprintf(thetaF, "%s_%s.theta", warm_stat.c_str(), get_channel_string(channel));
+    fin.open(thetaF);
+    general_assert(fin.is_open(), "Cannot open " + cstrtos(thetaF) + " to warm start from!");
+
+    assert(fin>> prev_M);
+    assert(fin>> noise);
+    if (noise > 0.0 && noise < 1.0) {
+      prob_noise[channel][0] = noise;
+      prob_noise[channel][1] = 1.0 - noise;
+    }
+
+    if (channel == 0) {
+      prev_values.assign(prev_M + 1, 0.0);
+      for (int i = 1; i <= prev_M; ++i) assert(fin>> prev_values[i]);
+    }
+
+    fin.close();
+  }
+
+  // load gamma and beta, file names follow write()
+  for (int channel = 0; channel < nchannels; ++channel) {
+    if (store != NULL) {
+      general_assert(store->hasArray(channel), cstrtos(paramF) + " does not contain the " + cstrtos(channel == 0 ? "gamma" : "beta") + " values to warm start from!");
+      prev_M = store->getM();
+      if (channel == 0) prev2tid.assign(prev_M + 1, 0);
+      for (int i = 1; i <= prev_M; ++i) {
+	iter = name2tid.find(store->getName(i));
+	tid = (iter != name2tid.end() && transcripts[iter->second]->getLen() == store->getLen(i) && !transcripts[iter->second]->isExcluded() && prev_values[i] > 0.0) ? iter->second : 0;
+	if (channel == 0) prev2tid[i] = tid;
+	if (tid > 0) transcripts[tid]->warmStart(store->getArray(i, channel), channel);
+      }
+      continue;
+    }
+
+    sprintf(paramF, "%s.%s", warm_sample.c_str(), (channel == 0 && has_control) ? "gamma" : "beta");
+    fin.open(paramF);
+    general_assert(fin.is_open(), "Cannot open " + cstrtos(paramF) + " to warm start from!");
+
+    assert((fin>> prev_M) && (prev_M == (int)prev_values.size() - 1));
+    if (channel == 0) prev2tid.assign(prev_M + 1, 0);
+    for (int i = 1; i <= prev_M; ++i) {
+      assert(fin>> name>> len);
+      iter = name2tid.find(name);
+      tid = (iter != name2tid.end() && transcripts[iter->second]->getLen() == len && !transcripts[iter->second]->isExcluded() && prev_values[i] > 0.0) ? iter->second : 0;
+      if (channel == 0) prev2tid[i] = tid;
+      if (tid > 0) transcripts[tid]->warmStart(fin, channel);
+      else getline(fin, line); // skip values
+    }
+
+    fin.close();
+  }
+
+  if (store != NULL) delete store;
+
+  std::vector<double> prev_theta(M + 1, 0.0);
+  for (int i = 1; i < (int)prev2tid.size(); ++i)
+    if (prev2tid[i] > 0) { value = prev_values[i]; prev_theta[prev2tid[i]] = value; sum += value; ++nmatched; }
+
+  // transcripts without a usable previous theta get the same share and the initial gamma/beta as in a cold start
+  for (int i = 1; i <= M; ++i) 
+    if (!transcripts[i]->isExcluded()) ++ntotal;
+  for (int i = 1; i <= M; ++i) 
+    if (!transcripts[i]->isExcluded()) 
+      theta[i] = prev_theta[i] > 0.0 ? prev_theta[i] / sum * nmatched / ntotal : 1.0 / ntotal;
+
+  if (verbose) printf("Warm started %d of %d transcripts from %s!\n", nmatched, ntotal, warm_sample.c_str());
+}
+
 void PROBerWholeModel::writeExprRes(int state, const char* output_name) {
   char exprF[STRLEN];
   double tpm[M + 1], fpkm[M + 1], l_bar;
@@ -347,7 +540,7 @@ void PROBerWholeModel::writeExprRes(int state, const char* output_name) {
   fout.close();
 }
 
-void PROBerWholeModel::write(const char* output_name, const char* statName) {
+void PROBerWholeModel::write(const char* output_name, const char* statName, bool binary) {
   char output_param[STRLEN];
   char output_theta[STRLEN];
   //  char output_rate[STRLEN];
@@ -358,7 +551,11 @@ void PROBerWholeModel::write(const char* output_name, const char* statName) {
   int state = PROBerTransModel::getState();
   assert(state < 3); 
 
-  if (state == 0 || state == 2) {
+  sprintf(output_param, "%s.params", output_name);
+  if (binary) writeParamStore(output_param, state);
+  else remove(output_param); // read and warm start prefer a parameter store whenever it exists, so remove a stale one
+
+  if (!binary && (state == 0 || state == 2)) {
     sprintf(output_param, "%s.%s", output_name, (state == 0 && !has_control) ? "beta" : "gamma");
     fout.open(output_param);
     assert(fout.is_open());
@@ -386,7 +583,7 @@ void PROBerWholeModel::write(const char* output_name, const char* statName) {
     fout.close();
   }
 
-  if (state == 1 || state == 2) {
+  if (!binary && (state == 1 || state == 2)) {
     sprintf(output_param, "%s.beta", output_name);
     fout.open(output_param);
     assert(fout.is_open());
@@ -420,6 +617,83 @@ void PROBerWholeModel::write(const char* output_name, const char* statName) {
   if (verbose) printf("PROBerWholeModel::write is finished!\n");
 }
 
+void PROBerWholeModel::writeParamStore(const char* storeF, int state) {
+  bool arrays[2] = {state == 0 || state == 2, state == 1 || state == 2}; // the same channels as the text files
+  int narrays = arrays[0] + arrays[1];
+
+  ParamStoreHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, ParamStore::MAGIC, sizeof(header.magic));
+  header.version = ParamStore::VERSION;
+  header.M = M;
+  header.flags = (has_control ? PS_HAS_CONTROL : 0) | (arrays[0] ? PS_ARRAY0 | PS_THETA0 : 0) | (arrays[1] ? PS_ARRAY1 | PS_THETA1 : 0);
+
+  // theta vectors, as in the .theta files
+  std::vector<double> thetas;
+  for (int c = 0; c < 2; ++c) 
+    if (arrays[c]) {
+      thetas.push_back(prob_noise[c][0]);
+      for (int i = 1; i <= M; ++i) thetas.push_back(prob_noise[c][1] * theta[i]);
+    }
+
+  // lay out the index, arrays and names
+  std::vector<ParamStoreEntry> index(M + 1);
+  std::string names;
+  uint64_t offset = sizeof(ParamStoreHeader) + sizeof(ParamStoreEntry) * (M + 1);
+
+  memset(&index[0], 0, sizeof(ParamStoreEntry) * (M + 1));
+  header.theta_offset = offset;
+  offset += sizeof(double) * thetas.size();
+  for (int i = 1; i <= M; ++i) {
+    index[i].offset = offset;
+    index[i].len = transcripts[i]->getLen();
+    index[i].name_offset = names.length();
+    names += transcripts[i]->getName();
+    names += '\0';
+    offset += sizeof(double) * narrays * index[i].len;
+  }
+  header.names_offset = offset;
+
+  int fd = open(storeF, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  general_assert(fd >= 0, "Cannot create " + cstrtos(storeF) + "!");
+
+  ParamStore::pwriteAll(fd, &header, sizeof(header), 0);
+  ParamStore::pwriteAll(fd, &index[0], sizeof(ParamStoreEntry) * (M + 1), sizeof(header));
+  ParamStore::pwriteAll(fd, &thetas[0], sizeof(double) * thetas.size(), header.theta_offset);
+  ParamStore::pwriteAll(fd, names.c_str(), names.length(), header.names_offset);
+
+  // split transcripts into ranges of about equal total length
+  double total = (header.names_offset - header.theta_offset) / (double)num_threads, acc = 0.0;
+  std::vector<StoreParams*> paramsVec;
+  int fr = 1;
+
+  for (int i = 0; i < num_threads; ++i) {
+    StoreParams *params = new StoreParams(i, this);
+    params->fd = fd;
+    params->index = &index[0];
+    params->arrays[0] = arrays[0]; params->arrays[1] = arrays[1];
+    params->fr = fr;
+    while (fr <= M && (i == num_threads - 1 || acc < total * (i + 1))) {
+      acc += sizeof(double) * narrays * index[fr].len;
+      ++fr;
+    }
+    params->to = fr;
+    paramsVec.push_back(params);
+  }
+
+  for (int i = 0; i < num_threads; ++i) {
+    rc = pthread_create(&threads[i], &attr, run_writeParamStore_per_thread, (void*)paramsVec[i]);
+    pthread_assert(rc, "pthread_create", "Cannot create thread " + itos(i) + " (numbered from 0) for run_writeParamStore_per_thread!");
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    rc = pthread_join(threads[i], NULL);
+    pthread_assert(rc, "pthread_join", "Cannot join thread " + itos(i) + " (numbered from 0) for run_writeParamStore_per_thread!");
+  }
+
+  for (int i = 0; i < num_threads; ++i) delete paramsVec[i];
+  general_assert(close(fd) == 0, "Cannot close " + cstrtos(storeF) + "!");
+}
+
 void PROBerWholeModel::startSimulation(int sim_tid) {
   int channel = PROBerTransModel::getChannel();
 
@@ -458,7 +732,7 @@ void PROBerWholeModel::finishSimulation() {
 void PROBerWholeModel::allocateTranscriptsToThreads(int state, int channel) {
   int id;
   MyHeap my_heap;
-  std::vector<int> max_lens; // record maximum len in each thread
+  int max_len; // maximum len among transcripts used in EM
 
   // Allocate transcripts for updating
   my_heap.init(num_threads);
@@ -466,8 +740,25 @@ void PROBerWholeModel::allocateTranscriptsToThreads(int state, int channel) {
   paramsVecU.assign(num_threads, NULL);
   for (int i = 0; i < num_threads; ++i) paramsVecU[i] = new Params(i, this);
 
+  // Index alignments of this channel, not needed if counts are accumulated during the E step
+  if (fused && shards.empty()) allocateShards();
+  if (fused)
+    for (int i = 0; i < num_threads; ++i) paramsVecU[i]->slices.assign(4 * shards.size(), NULL);
+  for (int i = 1; i <= M; ++i) 
+    if (fused) transcripts[i]->releaseAlignments(channel);
+    else transcripts[i]->buildAlignmentIndex(channel);
+
+  // A transcript holding more than half of a thread's fair share of alignments would make its thread the straggler, update it with all threads instead
+  HIT_INT_TYPE totAlign = 0;
+  for (int i = 1; i <= M; ++i) totAlign += transcripts[i]->getNumAlignments(channel);
+  splitTrans[channel].clear();
+
   for (int i = 1; i <= M; ++i) {
     HIT_INT_TYPE numAlign = transcripts[i]->getNumAlignments(channel);
+    if (!fused && num_threads > 1 && numAlign >= MIN_SPLIT_ALIGNMENTS && numAlign * 2 * num_threads > totAlign) {
+      splitTrans[channel].push_back(transcripts[i]);
+      continue;
+    }
     if (numAlign > 0) {
       id = my_heap.getTop();
       paramsVecU[id]->trans.push_back(transcripts[i]);
@@ -482,26 +773,51 @@ void PROBerWholeModel::allocateTranscriptsToThreads(int state, int channel) {
     paramsVecU[id] = NULL;
   }
   ++id;
-  assert(id > 0);
+  assert(id > 0 || splitTrans[channel].size() > 0);
   if (id < num_threads) paramsVecU.resize(id, NULL);
 
+  schedUp[channel] = Schedule();
+  schedUp[channel].costs.assign(M + 1, 0.0);
+
+  // allocate partial arrays for split transcripts
+  if (splitTrans[channel].size() > 0) {
+    if (paramsVecSlice.size() == 0) {
+      paramsVecSlice.assign(num_threads, NULL);
+      for (int i = 0; i < num_threads; ++i) paramsVecSlice[i] = new SliceParams(i, this);
+      slice_starts.assign(num_threads, NULL);
+      slice_ends.assign(num_threads, NULL);
+      slice_end_ses.assign(num_threads, NULL);
+      slice_sums.assign(num_threads, NULL);
+    }
+
+    int max_len = 0;
+    for (int i = 0; i < (int)splitTrans[channel].size(); ++i)
+      if (max_len < splitTrans[channel][i]->getLen()) max_len = splitTrans[channel][i]->getLen();
+    for (int i = 0; i < num_threads; ++i) {
+      paramsVecSlice[i]->reserve(max_len + 1);
+      slice_starts[i] = paramsVecSlice[i]->start;
+      slice_ends[i] = paramsVecSlice[i]->end;
+      slice_end_ses[i] = paramsVecSlice[i]->end_se;
+      slice_sums[i] = paramsVecSlice[i]->sums;
+    }
+  }
+
   if (state == 3) return;
 
   // Allocate transcripts for EM  
   my_heap.init(num_threads);
   paramsVecEM.assign(num_threads, NULL);
   for (int i = 0; i < num_threads; ++i) paramsVecEM[i] = new Params(i, this);
-  max_lens.assign(num_threads, 0);
+  max_len = 0;
 
   // allocate transcripts
   for (int i = 1; i <= M; ++i) 
     // If this transcript is not excluded 
     if (!transcripts[i]->isExcluded()) {
-      transcripts[i]->init(); // initialize this transcript for learning
       id = my_heap.getTop();
       paramsVecEM[id]->trans.push_back(transcripts[i]);
       ++paramsVecEM[id]->num_trans;
-      if (max_lens[id] < transcripts[i]->getLen()) max_lens[id] = transcripts[i]->getLen();
+      if (max_len < transcripts[i]->getLen()) max_len = transcripts[i]->getLen();
       my_heap.updateTop(transcripts[i]->getLen());
     }
 
@@ -514,15 +830,86 @@ void PROBerWholeModel::allocateTranscriptsToThreads(int state, int channel) {
   assert(id > 0);
   if (id < num_threads) paramsVecEM.resize(id, NULL);
 
-  // allocate start2 and end2 for each thread
+  schedEM = Schedule();
+  schedEM.costs.assign(M + 1, 0.0);
+
+  // initialize transcripts for learning, each thread's arrays are laid out in one slab in the order the thread processes them
+  for (int i = 0; i < (int)paramsVecEM.size(); ++i) {
+    for (int j = 0; j < paramsVecEM[i]->num_trans; ++j) 
+      paramsVecEM[i]->trans[j]->reserveArrays(&paramsVecEM[i]->arena);
+    paramsVecEM[i]->arena.allocate();
+    for (int j = 0; j < paramsVecEM[i]->num_trans; ++j) 
+      paramsVecEM[i]->trans[j]->init(&paramsVecEM[i]->arena);
+  }
+
+  // allocate start2 and end2 for each thread, large enough for any transcript since dynamic scheduling may run any transcript on any thread
   for (int i = 0; i < (int)paramsVecEM.size(); ++i) {
-    paramsVecEM[i]->start2 = new double[max_lens[i] + 1];
-    paramsVecEM[i]->end2 = new double[max_lens[i] + 1];
+    paramsVecEM[i]->start2 = new double[max_len + 1];
+    paramsVecEM[i]->end2 = new double[max_len + 1];
+    if (tracking) paramsVecEM[i]->prev = new double[2 * max_len];
     for (int j = 0; j < paramsVecEM[i]->num_trans; ++j)
       paramsVecEM[i]->trans[j]->setStart2andEnd2(paramsVecEM[i]->start2, paramsVecEM[i]->end2);
   }
 }
 
+void PROBerWholeModel::reindexAlignments(int channel, const std::vector<InMemChunk*>& chunks) {
+  if (fused) return; // counts are accumulated from the chunks directly, there is no index
+
+  InMemAlignG *a_read = NULL;
+  InMemAlign *aligns = NULL;
+
+  for (int i = 1; i <= M; ++i) transcripts[i]->clearAlignmentIndex(channel);
+
+  // re-add in the original order, so that the indices stay stable in read order
+  for (int i = 0; i < (int)chunks.size(); ++i) {
+    chunks[i]->reset();
+    while (chunks[i]->next(a_read, aligns)) 
+      for (int j = 0; j < a_read->size; ++j) 
+	transcripts[aligns[j].tid]->readdAlignment(aligns + j, channel);
+    chunks[i]->reset();
+  }
+
+  for (int i = 1; i <= M; ++i) transcripts[i]->buildAlignmentIndex(channel);
+}
+
+void PROBerWholeModel::allocateShards() {
+  // N_obs/N_se pairs first, then a block for each transcript with alignments in either channel
+  shardOffsets.assign(M + 1, 0);
+  shardSize = 2 * (M + 1);
+  for (int i = 1; i <= M; ++i) {
+    if (transcripts[i]->getNumAlignments(0) + transcripts[i]->getNumAlignments(1) == 0) continue;
+    shardOffsets[i] = shardSize;
+    shardSize += (transcripts[i]->getLen() + 1) * (transcripts[i]->hasSEReads() ? 3 : 2);
+  }
+
+  shards.assign(num_threads, NULL);
+  shardArenas.assign(num_threads, NULL);
+  for (int i = 0; i < num_threads; ++i) {
+    shardArenas[i] = new SlabArena();
+    shardArenas[i]->reserve(shardSize);
+    shardArenas[i]->allocate();
+    shards[i] = shardArenas[i]->alloc(shardSize);
+  }
+
+  if (verbose) printf("Count shards take %.2f MB per thread!\n", sizeof(double) * shardSize / 1048576.0);
+}
+
+void PROBerWholeModel::advanceSchedule(Schedule& sched, const std::vector<Params*>& paramsVec) {
+  sched.next = 0;
+  if (sched.order.size() > 0 || ++sched.ncalls < NUM_COST_ROUNDS) return;
+
+  std::vector<std::pair<double, int> > costs;
+  for (int i = 0; i < (int)paramsVec.size(); ++i)
+    for (int j = 0; j < paramsVec[i]->num_trans; ++j) {
+      int tid = paramsVec[i]->trans[j]->getTid();
+      costs.push_back(std::make_pair(-sched.costs[tid], tid));
+    }
+  std::sort(costs.begin(), costs.end());
+
+  sched.order.resize(costs.size());
+  for (int i = 0; i < (int)costs.size(); ++i) sched.order[i] = transcripts[costs[i].second];
+}
+
 void PROBerWholeModel::update(double count0) {
   int channel = PROBerTransModel::getChannel();
   std::vector<Params*> &paramsVecU = paramsVecUp[channel];
@@ -539,8 +926,50 @@ void PROBerWholeModel::update(double count0) {
     pthread_assert(rc, "pthread_join", "Cannot join thread " + itos(i) + " (numbered from 0) for run_makeUpdates_per_thread at " + cstrtos(get_channel_string(channel)) + " channel!");
   }    
 
+  advanceSchedule(schedUp[channel], paramsVecU);
+
+  for (int i = 0; i < (int)splitTrans[channel].size(); ++i) 
+    updateSplit(splitTrans[channel][i], channel);
+
   // Set counts
   counts[channel][0] = count0;
   for (int i = 1; i <= M; ++i)
     counts[channel][i] = transcripts[i]->getNobs(); // Because N_obs for each channel is stored separately, this operation is safe
 }
+
+void PROBerWholeModel::updateSplit(PROBerTransModel* tran, int channel) {
+  int size = paramsVecSlice.size();
+  HIT_INT_TYPE numAlign = tran->getNumIndexed(channel);
+  int len = tran->getLen() + 1;
+
+  for (int i = 0; i < size; ++i) {
+    SliceParams *params = paramsVecSlice[i];
+    params->tran = tran;
+    params->fr = numAlign * i / size;
+    params->to = numAlign * (i + 1) / size;
+    params->pfr = (long long)len * i / size;
+    params->pto = (long long)len * (i + 1) / size;
+  }
+
+  // scatter alignment slices
+  for (int i = 0; i < size; ++i) {
+    rc = pthread_create(&threads[i], &attr, run_updateSlice_per_thread, (void*)(paramsVecSlice[i]));
+    pthread_assert(rc, "pthread_create", "Cannot create thread " + itos(i) + " (numbered from 0) for run_updateSlice_per_thread at " + cstrtos(get_channel_string(channel)) + " channel!");
+  }
+  for (int i = 0; i < size; ++i) {
+    rc = pthread_join(threads[i], NULL);
+    pthread_assert(rc, "pthread_join", "Cannot join thread " + itos(i) + " (numbered from 0) for run_updateSlice_per_thread at " + cstrtos(get_channel_string(channel)) + " channel!");
+  }
+
+  // merge partial arrays
+  for (int i = 0; i < size; ++i) {
+    rc = pthread_create(&threads[i], &attr, run_mergeSlices_per_thread, (void*)(paramsVecSlice[i]));
+    pthread_assert(rc, "pthread_create", "Cannot create thread " + itos(i) + " (numbered from 0) for run_mergeSlices_per_thread at " + cstrtos(get_channel_string(channel)) + " channel!");
+  }
+  for (int i = 0; i < size; ++i) {
+    rc = pthread_join(threads[i], NULL);
+    pthread_assert(rc, "pthread_join", "Cannot join thread " + itos(i) + " (numbered from 0) for run_mergeSlices_per_thread at " + cstrtos(get_channel_string(channel)) + " channel!");
+  }
+
+  tran->finishSlices(size, &slice_sums[0]);
+}
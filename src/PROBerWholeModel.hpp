@@ -2,13 +2,17 @@
 #define PROBERWHOLEMODEL_H_
 
 #include<cmath>
+#include<cstring>
 #include<cassert>
+#include<string>
 #include<vector>
 #include<pthread.h>
 
 #include "sampling.hpp"
 #include "Transcripts.hpp"
 #include "InMemoryStructs.hpp"
+#include "SlabArena.hpp"
+#include "ParamStore.hpp"
 #include "PROBerTransModel.hpp"
 
 class PROBerWholeModel {
@@ -89,6 +93,71 @@ public:
     return prob_noise[PROBerTransModel::getChannel()][1] * theta[tid];
   }
 
+  /*
+    @param   prevSampleName   the sample name of a previous run, its gamma/beta files or parameter store are loaded
+    @param   prevStatName     the stat name of a previous run, its theta files are loaded
+    @comment: Start EM from a previous run's estimates instead of gamma_init/beta_init and a uniform theta. Transcripts are matched by name and length, unmatched ones start fresh. Call before init().
+   */
+  void setWarmStart(const char* prevSampleName, const char* prevStatName) {
+    warm_sample = prevSampleName;
+    warm_stat = prevStatName;
+  }
+
+  /*
+    @comment: Let the E step scatter the expected weights into per thread count shards with addCounts(), so that update() merges the shards instead of walking every transcript's alignments again.
+              The shards take num_threads times the memory of the start/end count arrays. Call before init().
+   */
+  void enableFusedCounts() { fused = true; }
+
+  /*
+    @comment: Let EM_step() measure how much it changes the parameters, see getThetaChange() and getGammaBetaChange().
+              Each EM thread then keeps a scratch copy of the arrays being updated. Call before init().
+   */
+  void enableChangeTracking() { tracking = true; }
+
+  /*
+    @return   the largest relative change of prob_noise[channel][0] and theta in the last EM_step(), only values of at least THETA_CHANGE_FLOOR are compared
+   */
+  double getThetaChange() const { return theta_change; }
+
+  /*
+    @return   the largest absolute change of any gamma/beta value in the last EM_step()
+   */
+  double getGammaBetaChange() const { return gamma_beta_change; }
+
+  /*
+    @param   shard   the E step thread's id, in [0, num_threads)
+    @comment: zero the thread's count shard, call at the beginning of each E step
+   */
+  void resetCounts(int shard) {
+    memset(shards[shard], 0, sizeof(double) * shardSize);
+  }
+
+  /*
+    @param   shard    the E step thread's id, in [0, num_threads)
+    @param   alignG   a read
+    @param   aligns   the read's alignments, frac must be normalized
+    @comment: add the read's expected weights to the counts of the current channel, as PROBerTransModel::updateSlice would
+   */
+  void addCounts(int shard, const InMemAlignG* alignG, const InMemAlign* aligns) {
+    double *base = shards[shard];
+    int primer_length = PROBerTransModel::get_primer_length();
+
+    for (int i = 0; i < alignG->size; ++i) {
+      if (aligns[i].conprb <= 0.0) continue; // discarded alignments or zero weights
+      int tid = aligns[i].tid, len1 = transcripts[tid]->getLen() + 1;
+      double frac = aligns[i].frac, *block = base + shardOffsets[tid];
+
+      block[len1 + aligns[i].pos] += frac; // end
+      if (aligns[i].fragment_length > 0) block[aligns[i].pos + aligns[i].fragment_length - primer_length] += frac; // start
+      else {
+	block[2 * len1 + aligns[i].pos] += frac; // end_se
+	base[2 * tid + 1] += frac;
+      }
+      base[2 * tid] += frac;
+    }
+  }
+
   /*
     @comment: Allocate transcripts to threads, calculate auxiliary arrays by calling PROBerTransModel::init() for each transcript and initialize theta
    */
@@ -109,14 +178,23 @@ public:
   /*
     @param   input_name   the prefix for input files, e.g. gamma and beta files
     @param   statName     the prefix for learned model parameter files, e.g. theta files
+    @comment: if input_name.params is a parameter store, all parameters are loaded from it instead
    */
   void read(const char* input_name, const char* statName = NULL);
 
   /*
     @param   output_name   the prefix for output files, e.g. gamma and beta files
     @param   statName      the prefix for learned model parameter files, e.g. theta files
+    @param   binary        if true, write gamma, beta and theta into the parameter store output_name.params instead of text files
    */
-  void write(const char* output_name, const char* statName);
+  void write(const char* output_name, const char* statName, bool binary = false);
+
+  /*
+    @param   channel   the channel whose alignments were pruned
+    @param   chunks    all in memory chunks of channel, already compacted by InMemChunk::prune
+    @comment: Rebuild the alignment indices of channel, whose frac pointers are invalid once the chunks are compacted
+   */
+  void reindexAlignments(int channel, const std::vector<InMemChunk*>& chunks);
 
   /*
     @param   sim_tid   if only simulate reads from sim_tid, default is not (-1)
@@ -152,6 +230,7 @@ private:
   int M; // Number of transcripts
   std::vector<double> theta; // M + 1 elements. If we learn parameters, theta[0] = 0 and sum_{i=1}^{M} theta[i] = 1, the actual fraction of i is prob_noise[channel][i] * theta[i]; However, if we simulate, theta[0] > 0, theta[i] represents the actual fraction of reads coming from transcript i and sum_{i=0}^{M} theta[i] = 1.
   std::vector<PROBerTransModel*> transcripts; // PROBer models for individual transcripts
+  SlabArena *paramArena; // holds gamma and beta of all transcripts when learning
 
   std::vector<double> counts[2]; //, unobserved[2]; // number of observed/unobserved reads fall into each transcript for two channels
   
@@ -167,6 +246,19 @@ private:
   int channel_to_calc; // the channel to calculate auxiliary arrays
 
   bool has_control; // if the experiment has a control
+
+  bool fused; // if the E step accumulates counts into shards
+  std::vector<double*> shards; // one count shard per E step thread, laid out as N_obs/N_se pairs for all tids, then start, end (and end_se if hasSE) of each transcript with alignments
+  std::vector<SlabArena*> shardArenas; // memory of the shards
+  std::vector<size_t> shardOffsets; // offset of each transcript's count block within a shard
+  size_t shardSize; // number of doubles per shard
+
+  bool tracking; // if EM_step() measures parameter changes
+  double theta_change, gamma_beta_change; // see getThetaChange() and getGammaBetaChange()
+  std::vector<double> last_theta; // theta before the last EM_step(), if tracking
+  static const double THETA_CHANGE_FLOOR; // smaller theta values are ignored when measuring the relative change
+
+  std::string warm_sample, warm_stat; // name prefixes of a previous run to warm start from, empty if not warm starting
   
 
   // Params, used for multi-threading
@@ -178,19 +270,101 @@ private:
     std::vector<PROBerTransModel*> trans;
 
     double *start2, *end2;
+    double *prev; // scratch for PROBerTransModel::EM_step(prev), only if tracking parameter changes
+    std::vector<double*> slices; // scratch for makeUpdate, 4 pointers per count shard, only if fused
+
+    SlabArena arena; // holds the arrays of the transcripts allocated to this thread for EM
 
     Params(int id, PROBerWholeModel *pointer) : id(id), pointer(pointer) {
       num_trans = 0;
       trans.clear();
-      start2 = end2 = NULL;
+      start2 = end2 = prev = NULL;
     }
     
     ~Params() {
       if (start2 != NULL) delete[] start2;
       if (end2 != NULL) delete[] end2;
+      if (prev != NULL) delete[] prev;
+    }
+  };
+
+  // SliceParams, used by threads sharing the update of one highly covered transcript
+  struct SliceParams {
+    int id;
+    PROBerWholeModel *pointer;
+
+    PROBerTransModel *tran; // the transcript being updated
+    HIT_INT_TYPE fr, to; // alignments [fr, to) are scattered by this thread
+    int pfr, pto; // positions [pfr, pto) are merged by this thread
+
+    int capacity; // number of entries allocated for each partial array
+    double *start, *end, *end_se; // thread private partial counts
+    double sums[2]; // partial N_obs and N_se
+
+    SliceParams(int id, PROBerWholeModel *pointer) : id(id), pointer(pointer) {
+      tran = NULL;
+      fr = to = 0;
+      pfr = pto = 0;
+      capacity = 0;
+      start = end = end_se = NULL;
+      sums[0] = sums[1] = 0.0;
+    }
+
+    ~SliceParams() {
+      if (start != NULL) delete[] start;
+      if (end != NULL) delete[] end;
+      if (end_se != NULL) delete[] end_se;
+    }
+
+    void reserve(int size) {
+      if (capacity >= size) return;
+      if (start != NULL) { delete[] start; delete[] end; delete[] end_se; }
+      capacity = size;
+      start = new double[capacity];
+      end = new double[capacity];
+      end_se = new double[capacity];
+    }
+  };
+
+  // StoreParams, used by threads writing the parameter store
+  struct StoreParams {
+    int id;
+    PROBerWholeModel *pointer;
+
+    int fd; // the parameter store
+    int fr, to; // transcripts [fr, to) are written by this thread
+    const ParamStoreEntry *index; // the parameter store index
+    bool arrays[2]; // which of gamma (0) and beta (1) are written
+
+    StoreParams(int id, PROBerWholeModel *pointer) : id(id), pointer(pointer) {
+      fd = -1;
+      fr = to = 0;
+      index = NULL;
+      arrays[0] = arrays[1] = false;
     }
   };
 
+  static const int NUM_COST_ROUNDS = 2; // number of calls in which a phase runs its static allocation and measures per transcript costs
+
+  // Schedule, used for dynamic scheduling of one phase. In the first NUM_COST_ROUNDS calls, transcripts run under the static allocation and their costs are recorded.
+  // Afterwards transcripts are ordered by decreasing cost and threads take the next transcript from a shared index (longest processing time first).
+  struct Schedule {
+    int ncalls; // number of calls of this phase so far
+    std::vector<double> costs; // measured cost of each transcript in seconds, indexed by tid
+    std::vector<PROBerTransModel*> order; // transcripts ordered by decreasing cost, empty while measuring
+    volatile int next; // the shared work index
+
+    Schedule() { ncalls = 0; costs.clear(); order.clear(); next = 0; }
+  };
+
+  Schedule schedUp[2], schedEM; // schedules for updates and EM steps
+
+  static const HIT_INT_TYPE MIN_SPLIT_ALIGNMENTS = 65536; // a transcript is never split if it has fewer alignments than this
+
+  std::vector<PROBerTransModel*> splitTrans[2]; // highly covered transcripts, each updated by all threads together
+  std::vector<SliceParams*> paramsVecSlice; // parameters used by each thread for updating a split transcript
+  std::vector<double*> slice_starts, slice_ends, slice_end_ses, slice_sums; // per slice pointers passed to PROBerTransModel::mergeSlices and finishSlices
+
   std::vector<pthread_t> threads; // pthreads
   pthread_attr_t attr; // pthread attribute
   int rc; // status of pthread running condition
@@ -225,6 +399,13 @@ private:
    */
   void update(double count0);
 
+  /*
+    @param   tran      a highly covered transcript
+    @param   channel   the current channel
+    @comment: Update tran with all threads. Each thread scatters a slice of the alignments into its own partial arrays, then each thread merges a range of positions.
+   */
+  void updateSplit(PROBerTransModel* tran, int channel);
+
   /*
     @param  state   the current state
     @param  output_name   the output name prefix for this data set
@@ -232,19 +413,133 @@ private:
    */
   void writeExprRes(int state, const char* output_name);
 
+  /*
+    @param   storeF   the parameter store file name
+    @param   state    the current state
+    @comment: Write the index and theta serially, then each thread writes the gamma/beta arrays of a range of transcripts in place
+   */
+  void writeParamStore(const char* storeF, int state);
+
+  /*
+    @param   store      a parameter store
+    @param   state      the current state
+    @param   learning   if we are learning parameters
+    @comment: the counterpart of read() for text files
+   */
+  void readParamStore(const ParamStore& store, int state, bool learning);
+
+  /*
+    @param   state   the initial state
+    @comment: Overwrite the initial gamma/beta, theta and prob_noise with values from the previous run set by setWarmStart
+   */
+  void loadWarmStart(int state);
+
+  /*
+    @comment: lay out and allocate the count shards, called once all alignments are added
+   */
+  void allocateShards();
+
+  /*
+    @param   tran     a transcript with alignments in the current channel
+    @param   params   the calling thread's parameters
+    @comment: Update tran's counts, from its alignments or by merging the count shards if fused
+   */
+  void makeUpdate(PROBerTransModel* tran, Params* params) {
+    if (!fused) { tran->update(); return; }
+
+    int tid = tran->getTid(), len1 = tran->getLen() + 1, size = shards.size();
+    assert((int)params->slices.size() == 4 * size);
+    double **p_starts = &params->slices[0], **p_ends = p_starts + size, **p_end_ses = p_ends + size, **p_sums = p_end_ses + size;
+
+    for (int k = 0; k < size; ++k) {
+      p_starts[k] = shards[k] + shardOffsets[tid];
+      p_ends[k] = p_starts[k] + len1;
+      p_end_ses[k] = p_ends[k] + len1;
+      p_sums[k] = shards[k] + 2 * tid;
+    }
+    tran->mergeSlices(0, len1, size, p_starts, p_ends, p_end_ses);
+    tran->finishSlices(size, p_sums);
+  }
+
+  /*
+    @param   sched       the schedule of a phase that just finished a call
+    @param   paramsVec   the static allocation of this phase
+    @comment: Count the call. Once NUM_COST_ROUNDS calls are measured, order transcripts by decreasing cost. Reset the shared work index.
+   */
+  void advanceSchedule(Schedule& sched, const std::vector<Params*>& paramsVec);
+
   void run_calcAuxiliaryArrays(Params* params) {
     for (int i = 0; i < params->num_trans; ++i)  
       params->trans[i]->calcAuxiliaryArrays(channel_to_calc);
   }
 
   void run_makeUpdates(Params* params) {
-    for (int i = 0; i < params->num_trans; ++i) 
-      params->trans[i]->update();
+    Schedule &sched = schedUp[PROBerTransModel::getChannel()];
+    int size = sched.order.size();
+    
+    if (size > 0) {
+      int i;
+      while ((i = __sync_fetch_and_add(&sched.next, 1)) < size) 
+	makeUpdate(sched.order[i], params);
+    }
+    else {
+      for (int i = 0; i < params->num_trans; ++i) {
+	double start_time = getTime();
+	makeUpdate(params->trans[i], params);
+	sched.costs[params->trans[i]->getTid()] += getTime() - start_time;
+      }
+    }
   }
 
   void run_EM_step(Params* params) {
-    for (int i = 0; i < params->num_trans; ++i)
-      params->trans[i]->EM_step();
+    int size = schedEM.order.size();
+
+    if (size > 0) {
+      int i;
+      while ((i = __sync_fetch_and_add(&schedEM.next, 1)) < size) {
+	schedEM.order[i]->setStart2andEnd2(params->start2, params->end2); // transcripts move between threads, use this thread's buffers
+	if (tracking) schedEM.order[i]->EM_step(params->prev);
+	else schedEM.order[i]->EM_step();
+      }
+    }
+    else {
+      for (int i = 0; i < params->num_trans; ++i) {
+	double start_time = getTime();
+	if (tracking) params->trans[i]->EM_step(params->prev);
+	else params->trans[i]->EM_step();
+	schedEM.costs[params->trans[i]->getTid()] += getTime() - start_time;
+      }
+    }
+  }
+
+  static void* run_updateSlice_per_thread(void* args) {
+    SliceParams *params = (SliceParams*)args;
+    params->tran->updateSlice(params->fr, params->to, params->start, params->end, params->end_se, params->sums);
+    return NULL;
+  }
+
+  static void* run_mergeSlices_per_thread(void* args) {
+    SliceParams *params = (SliceParams*)args;
+    PROBerWholeModel *pointer = params->pointer;
+    params->tran->mergeSlices(params->pfr, params->pto, pointer->paramsVecSlice.size(), &pointer->slice_starts[0], &pointer->slice_ends[0], &pointer->slice_end_ses[0]);
+    return NULL;
+  }
+
+  static void* run_writeParamStore_per_thread(void* args) {
+    StoreParams *params = (StoreParams*)args;
+    PROBerWholeModel *pointer = params->pointer;
+
+    for (int i = params->fr; i < params->to; ++i) {
+      uint64_t offset = params->index[i].offset;
+      size_t bytes = sizeof(double) * params->index[i].len;
+      for (int c = 0; c < 2; ++c) 
+	if (params->arrays[c]) {
+	  ParamStore::pwriteAll(params->fd, pointer->transcripts[i]->getOutputArray(c), bytes, offset);
+	  offset += bytes;
+	}
+    }
+
+    return NULL;
   }
 
   static void* run_calcAuxiliaryArrays_per_thread(void* args) {
@@ -7,13 +7,13 @@
 #include<vector>
 #include<set>
 #include<fstream>
+#include<algorithm>
 #include<pthread.h>
 
 #include "htslib/sam.h"
 
 #include "utils.h"
 #include "my_assert.h"
-#include "MyHeap.hpp"
 #include "InMemoryStructs.hpp"
 #include "PROBerTransModelS.hpp"
 
@@ -21,14 +21,24 @@ using namespace std;
 
 const int MAX_ROUND = 1000; // default maximum iterations                                                                                                                                                
 const double deltaChange = 5e-6; // default log-probability change per read   
+const double weightTol = 1e-3; // the weight EM stops once no theta of at least 1e-7 changes relatively more than this
 
 struct ATranscript {
-  PROBerTransModelS *model;
+  PROBerTransModelS *model; // released as soon as its results are formatted
   double Nobs[2]; // minus and plus channel observed reads
+  int part; // the thread whose part files hold the results, -1 if not done yet
+  streamoff gpos, bpos; // where the gamma and beta lines start in the part files
+  int glen, blen; // lengths of the two lines
+  string name; // transcript name, kept after model is released
+  int rounds; // number of EM rounds run
 
   ATranscript() {
     model = NULL;
     Nobs[0] = Nobs[1] = 0.0;
+    part = -1;
+    gpos = bpos = 0;
+    glen = blen = 0;
+    rounds = 0;
   }
 
   ~ATranscript() {
@@ -38,14 +48,25 @@ struct ATranscript {
 
 struct TransVecPerThread {
   int no; // thread id
-  int s; // total number of transcripts in this thread
-  vector<ATranscript*> trans; // transcript vector
+  int s; // number of transcripts processed by this thread
+  ofstream *gout, *bout; // part files, results in the order this thread finishes them
 
   TransVecPerThread() {
-    no = -1; s = 0; trans.clear();
+    no = -1; s = 0;
+    gout = bout = NULL;
   }
 };
 
+struct ParseParams {
+  char *inpF; // BAM file of this channel
+  int channel; // 0, minus channel; 1, plus channel
+};
+
+// Longest first, so that the last transcripts taken from the queue are short ones
+bool longerFirst(const ATranscript* a, const ATranscript* b) {
+  return a->model->getLen() > b->model->getLen();
+}
+
 
 bool isJoint;
 bool turnOnHidden;
@@ -56,6 +77,9 @@ bool paired_end;
 int nthreads;
 char inputList[STRLEN];
 bool isMAP;
+bool accelerate; // if EM is accelerated with SQUAREM
+bool write_rounds; // if write the number of EM rounds of each transcript
+bool estimate_weights; // if inputs are aligner outputs without ZW weights, which are then estimated in-process
 
 int M; // total number of transcripts
 vector<ATranscript*> trans; // link to transcript model of each transcript, can be null
@@ -65,6 +89,11 @@ int rc;
 pthread_attr_t attr;
 vector<pthread_t> threads;
 vector<TransVecPerThread> transvec;
+vector<ATranscript*> queue; // transcripts to run EM on, taken by idle threads in order
+int next_tran; // index of the next transcript in queue to take
+
+// results are written in transcript order as soon as all transcripts before them are done
+char partPrefix[STRLEN]; // part files are partPrefix_<thread>.gamma and partPrefix_<thread>.beta
 
 void setupConfig(char* configF) {
   FILE *fi;
@@ -85,7 +114,6 @@ void assignTranscripts(char* inpBamF, char* listF) {
   samFile *in;
   bam_hdr_t *header;
   set<string> inList;
-  MyHeap aheap;
   ATranscript *atran;
 
   // Load list of transcripts that we are interested, if listF == NULL, all transcripts are considered
@@ -113,25 +141,82 @@ void assignTranscripts(char* inpBamF, char* listF) {
 
   M = header->n_targets;
   trans.assign(M, NULL);
-  aheap.init(nthreads);
+  queue.clear();
 
-  int pid;
   for (int i = 0; i < M; ++i)
     if (listF[0] == 0 || inList.find(string(header->target_name[i])) != inList.end()) {
       atran = new ATranscript();
       atran->model = new PROBerTransModelS(i, header->target_name[i], header->target_len[i]);
+      atran->name = header->target_name[i];
       trans[i] = atran;
-      pid = aheap.getTop();
-      aheap.updateTop(atran->model->getLen());
-      transvec[pid].trans.push_back(atran);
-      ++transvec[pid].s;
+      queue.push_back(atran);
     }
 
+  // Convergence time varies a lot between transcripts, so threads take transcripts from a shared queue instead of fixed buckets
+  stable_sort(queue.begin(), queue.end(), longerFirst);
+  next_tran = 0;
+
   bam_hdr_destroy(header);
   sam_close(in);
 }
 
-void parseAlignments(char *inpF, int channel) {
+/*
+  @param   aligns      alignments of a channel, grouped by read
+  @param   readStarts  index of each read's first alignment in aligns, followed by aligns.size()
+  @param   header      BAM header, giving transcript lengths
+  @comment: Allocate multi-mapping reads to transcripts with a theta only EM, an alignment to transcript t has weight theta_t / length_t, and set each alignment's frac.
+            All transcripts take part, not only those of interest, so that reads are shared with the transcripts they compete with.
+ */
+void estimateWeights(vector<InMemAlign>& aligns, const vector<HIT_INT_TYPE>& readStarts, const bam_hdr_t* header, int channel) {
+  int nreads = (int)readStarts.size() - 1;
+  vector<double> theta(M, 1.0 / M), counts(M), uniqueCounts(M, 0.0), invLen(M);
+  double sum, change;
+  int ROUND;
+
+  if (nreads <= 0) return;
+
+  for (int i = 0; i < M; ++i) invLen[i] = 1.0 / header->target_len[i];
+
+  // unique reads always have weight 1
+  for (int r = 0; r < nreads; ++r) 
+    if (readStarts[r + 1] - readStarts[r] == 1) {
+      aligns[readStarts[r]].frac = 1.0;
+      uniqueCounts[aligns[readStarts[r]].tid] += 1.0;
+    }
+
+  for (ROUND = 1; ROUND <= MAX_ROUND; ++ROUND) {
+    counts = uniqueCounts;
+    for (int r = 0; r < nreads; ++r) {
+      HIT_INT_TYPE fr = readStarts[r], to = readStarts[r + 1];
+      if (to - fr == 1) continue;
+      sum = 0.0;
+      for (HIT_INT_TYPE j = fr; j < to; ++j) {
+	aligns[j].frac = theta[aligns[j].tid] * invLen[aligns[j].tid];
+	sum += aligns[j].frac;
+      }
+      assert(sum > 0.0);
+      for (HIT_INT_TYPE j = fr; j < to; ++j) {
+	aligns[j].frac /= sum;
+	counts[aligns[j].tid] += aligns[j].frac;
+      }
+    }
+
+    change = 0.0;
+    for (int i = 0; i < M; ++i) {
+      counts[i] /= nreads;
+      if (counts[i] >= 1e-7) change = max(change, fabs(counts[i] - theta[i]) / counts[i]);
+    }
+    theta.swap(counts);
+    if (change < weightTol) break;
+  }
+
+  printf("Weights of %d reads for %s channel are estimated in %d rounds!\n", nreads, channelStr[channel], min(ROUND, MAX_ROUND));
+}
+
+void* parseAlignments(void* arg) {
+  ParseParams *params = (ParseParams*)arg;
+  char *inpF = params->inpF;
+  int channel = params->channel;
   samFile *in;
   bam_hdr_t *header;
 
@@ -141,6 +226,10 @@ void parseAlignments(char *inpF, int channel) {
 
   int cnt = 0;
 
+  vector<InMemAlign> aligns; // if estimate_weights, all alignments grouped by read
+  vector<HIT_INT_TYPE> readStarts;
+  string last_qname;
+
   in = sam_open(inpF, "r");
   header = sam_hdr_read(in);
   b = bam_init1();
@@ -158,106 +247,201 @@ void parseAlignments(char *inpF, int channel) {
     }
 
     if (is_paired && !(b->core.flag & 0x0040)) continue; // If paired-end and not the first mate, continue
+    if (estimate_weights && (b->core.flag & 0x0010)) continue; // aligners report reverse strand alignments, which a strand specific protocol cannot produce
     assert(!(b->core.flag & 0x0010));
     //    if (b->core.flag & 0x0010) continue; // If read aligns to the reverse strand
 
-    if (trans[b->core.tid] == NULL) continue;
+    if (!estimate_weights && trans[b->core.tid] == NULL) continue;
     
     ima.pos = b->core.pos;
     ima.fragment_length = (is_paired ? abs(b->core.isize) : (b->core.l_qseq < read_length ? b->core.l_qseq : 0));
     assert(ima.fragment_length >= 0);
+
+    if (estimate_weights) {
+      // alignments of a read are consecutive
+      if (readStarts.empty() || last_qname != bam_get_qname(b)) {
+	readStarts.push_back(aligns.size());
+	last_qname = bam_get_qname(b);
+      }
+      ima.tid = b->core.tid;
+      aligns.push_back(ima);
+      continue;
+    }
+
     uint8_t *p_tag = bam_aux_get(b, "ZW");
     assert(p_tag != NULL);
     ima.frac = double(bam_aux2f(p_tag));
     
-    trans[b->core.tid]->model->addAlignment(&ima);
+    trans[b->core.tid]->model->addAlignment(&ima, channel);
     trans[b->core.tid]->Nobs[channel] += ima.frac;
   }
 
-  // flip state for the next step
-  for (int i = 0; i < M; ++i) 
-    if (trans[i] != NULL) trans[i]->model->flipState();
+  if (estimate_weights) {
+    readStarts.push_back(aligns.size());
+    estimateWeights(aligns, readStarts, header, channel);
+    for (size_t i = 0; i < aligns.size(); ++i) 
+      if (trans[aligns[i].tid] != NULL) {
+	trans[aligns[i].tid]->model->addAlignment(&aligns[i], channel);
+	trans[aligns[i].tid]->Nobs[channel] += aligns[i].frac;
+      }
+  }
 
   bam_destroy1(b);
   bam_hdr_destroy(header);
   sam_close(in);
-}
-
-void* runEM(void* arg) {
-  TransVecPerThread *params = (TransVecPerThread*)arg;
-  ATranscript *atran;
-  PROBerTransModelS *model;
-  int channel;
 
-  double prev_logprob, curr_logprob;
-  double change;
+  printf("parseAlignments for '%s' is done!\n", channel == 0 ? "-" : "+");
 
-  for (int i = 0; i < params->s; ++i) {
-    atran = params->trans[i];
-    model = atran->model;
+  return NULL;
+}
 
-    prev_logprob = curr_logprob = -1e300;
+/*
+  Threads take transcripts longest first, far from the output order. Instead of holding finished transcripts in memory until all
+  transcripts before them are done, each thread appends its results to its own part files as soon as a transcript converges.
+  Every line starts with the transcript name, so the part files can be read while the batch runs. The offsets of each
+  transcript's lines are kept, and closeOutputs assembles the ordered gamma and beta files from them.
+ */
+void openOutputs(char* outName) {
+  char outF[STRLEN];
 
-    // initialize
-    model->init();
-  
-    // joint mode, EM
-    channel = model->getChannel();
-    assert(channel == 0);
-    model->calcAuxiliaryArrays(channel);
+  strcpy(partPrefix, outName);
+  for (int i = 0; i < nthreads; ++i) {
+    sprintf(outF, "%s_%d.gamma", partPrefix, i);
+    transvec[i].gout = new ofstream(outF);
+    general_assert(transvec[i].gout->is_open(), "Cannot create " + cstrtos(outF) + "!");
+    sprintf(outF, "%s_%d.beta", partPrefix, i);
+    transvec[i].bout = new ofstream(outF);
+    general_assert(transvec[i].bout->is_open(), "Cannot create " + cstrtos(outF) + "!");
+  }
+}
 
+// Write the results of a converged transcript to the thread's part files and release its model
+void finishTranscript(ATranscript* atran, TransVecPerThread* params) {
+  ofstream *gout = params->gout, *bout = params->bout;
+
+  gout->precision(10);
+  gout->unsetf(std::ios::floatfield);
+  bout->precision(10);
+  bout->unsetf(std::ios::floatfield);
+
+  atran->part = params->no;
+  atran->gpos = gout->tellp();
+  atran->model->write(*gout, 0);
+  atran->glen = gout->tellp() - atran->gpos;
+  atran->bpos = bout->tellp();
+  atran->model->write(*bout, 1);
+  atran->blen = bout->tellp() - atran->bpos;
+  gout->flush(); bout->flush();
+
+  delete atran->model;
+  atran->model = NULL;
+}
 
-    for (int ROUND = 1; ROUND <= MAX_ROUND; ++ROUND) {
-      curr_logprob = model->getLogProbT(channel);
-      model->EM_step(atran->Nobs[channel] / model->getProbPass(channel));
-      model->flipState();
-      channel = model->getChannel();
-      curr_logprob += model->getLogProbT(channel);
-      model->EM_step(atran->Nobs[channel] / model->getProbPass(channel));
-      model->flipState();
-      channel = model->getChannel();
+void* runEM(void* arg) {
+  TransVecPerThread *params = (TransVecPerThread*)arg;
+  ATranscript *atran;
 
-      change = (curr_logprob - prev_logprob) / (atran->Nobs[0] + atran->Nobs[1]);
-      //      printf("ROUND %d, logprob = %.10g, deltachange = %.10g\n", ROUND - 1, curr_logprob, change);
+  int size = queue.size(), i;
+  while ((i = __sync_fetch_and_add(&next_tran, 1)) < size) {
+    atran = queue[i];
 
-      if (change <= deltaChange) break;
+    // joint mode, EM
+    atran->rounds = atran->model->runEM(atran->Nobs, MAX_ROUND, deltaChange, accelerate);
 
-      prev_logprob = curr_logprob;
-    }
+    finishTranscript(atran, params);
 
-    if ((i + 1) % 50 == 0) printf("%d transcripts are processed in thread %d!\n", (i + 1), params->no);
+    ++params->s;
+    if (params->s % 50 == 0) printf("%d transcripts are processed in thread %d!\n", params->s, params->no);
   }
   
   return NULL;
 }
 
-void writeItOut(char* outName) {
+// Copy len bytes at pos of fin to fout
+void copyLine(ifstream& fin, streamoff pos, int len, ofstream& fout, vector<char>& buffer) {
+  if ((int)buffer.size() < len) buffer.resize(len);
+  fin.seekg(pos);
+  general_assert(len > 0 && (bool)fin.read(&buffer[0], len), "Cannot read back a part file!");
+  fout.write(&buffer[0], len);
+}
+
+void closeOutputs(char* outName) {
   char outF[STRLEN];
-  ofstream fout;
+  vector<ifstream*> gins(nthreads, NULL), bins(nthreads, NULL);
+  vector<char> buffer;
+  ofstream gout, bout;
 
-  sprintf(outF, "%s.gamma", outName);
-  fout.open(outF);
-  fout.precision(10);
-  fout.unsetf(std::ios::floatfield);
-  fout<< M<< endl;
-  for (int i = 0; i < M; ++i) {
-    if (trans[i] != NULL) trans[i]->model->write(fout, 0);
-    else fout<< endl;
+  for (int i = 0; i < nthreads; ++i) {
+    delete transvec[i].gout;
+    delete transvec[i].bout;
+    sprintf(outF, "%s_%d.gamma", partPrefix, i);
+    gins[i] = new ifstream(outF, ios::binary);
+    sprintf(outF, "%s_%d.beta", partPrefix, i);
+    bins[i] = new ifstream(outF, ios::binary);
   }
-  fout.close();
-  printf("Gamma file is written!\n");
 
+  sprintf(outF, "%s.gamma", outName);
+  gout.open(outF);
+  general_assert(gout.is_open(), "Cannot create " + cstrtos(outF) + "!");
   sprintf(outF, "%s.beta", outName);
-  fout.open(outF);
-  fout.precision(10);
-  fout.unsetf(std::ios::floatfield);
-  fout<< M<< endl;
+  bout.open(outF);
+  general_assert(bout.is_open(), "Cannot create " + cstrtos(outF) + "!");
+
+  gout<< M<< endl;
+  bout<< M<< endl;
   for (int i = 0; i < M; ++i) {
-    if (trans[i] != NULL) trans[i]->model->write(fout, 1);
-    else fout<< endl;
+    if (trans[i] != NULL) {
+      assert(trans[i]->part >= 0);
+      copyLine(*gins[trans[i]->part], trans[i]->gpos, trans[i]->glen, gout, buffer);
+      copyLine(*bins[trans[i]->part], trans[i]->bpos, trans[i]->blen, bout, buffer);
+    }
+    else {
+      // transcripts that are not of interest
+      gout<< endl;
+      bout<< endl;
+    }
   }
-  fout.close();
+
+  gout.close();
+  printf("Gamma file is written!\n");
+  bout.close();
   printf("Beta file is written!\n");
+
+  for (int i = 0; i < nthreads; ++i) {
+    delete gins[i];
+    delete bins[i];
+    sprintf(outF, "%s_%d.gamma", partPrefix, i);
+    remove(outF);
+    sprintf(outF, "%s_%d.beta", partPrefix, i);
+    remove(outF);
+  }
+}
+
+// Summarize the number of EM rounds per transcript, and write them out if required
+void reportRounds(char* outName) {
+  vector<int> nrounds;
+  long long total = 0;
+
+  for (size_t i = 0; i < queue.size(); ++i) {
+    nrounds.push_back(queue[i]->rounds);
+    total += queue[i]->rounds;
+  }
+  if (nrounds.empty()) return;
+  sort(nrounds.begin(), nrounds.end());
+
+  int n = nrounds.size();
+  printf("EM rounds per transcript%s: min %d, median %d, 90th percentile %d, max %d, total %lld\n", (accelerate ? " (SQUAREM)" : ""), 
+	 nrounds[0], nrounds[n / 2], nrounds[min(n - 1, (int)(0.9 * n))], nrounds[n - 1], total);
+
+  if (write_rounds) {
+    char outF[STRLEN];
+    sprintf(outF, "%s.rounds", outName);
+    ofstream fout(outF);
+    general_assert(fout.is_open(), "Cannot create " + cstrtos(outF) + "!");
+    for (int i = 0; i < M; ++i) 
+      if (trans[i] != NULL) fout<< trans[i]->name<< '\t'<< trans[i]->rounds<< endl;
+    fout.close();
+  }
 }
 
 void release() {
@@ -269,7 +453,7 @@ void release() {
 
 int main(int argc, char* argv[]) {
   if (argc < 5) {
-    printf("Usage: PROBer_single_transcript_batch config_file minus_channel.bam plus_channel.bam output_name [--read-length read_length] [--paired-end] [--input input_list.txt] [-p number_of_threads] [--maximum-likelihood] [--turn-on-hidden]\n");
+    printf("Usage: PROBer_single_transcript_batch config_file minus_channel.bam plus_channel.bam output_name [--read-length read_length] [--paired-end] [--input input_list.txt] [-p number_of_threads] [--maximum-likelihood] [--turn-on-hidden] [--estimate-weights] [--accelerate] [--write-rounds]\n");
     exit(-1);
   }
 
@@ -281,6 +465,9 @@ int main(int argc, char* argv[]) {
   inputList[0] = 0;
   nthreads = 1;
   isMAP = true;
+  estimate_weights = false;
+  accelerate = false;
+  write_rounds = false;
 
   for (int i = 5; i < argc; ++i) {
     if (!strcmp(argv[i], "--read-length")) {
@@ -301,6 +488,15 @@ int main(int argc, char* argv[]) {
     if (!strcmp(argv[i], "--turn-on-hidden")) {
       turnOnHidden = true;
     }
+    if (!strcmp(argv[i], "--estimate-weights")) {
+      estimate_weights = true;
+    }
+    if (!strcmp(argv[i], "--accelerate")) {
+      accelerate = true;
+    }
+    if (!strcmp(argv[i], "--write-rounds")) {
+      write_rounds = true;
+    }
   }
 
   // set up global parameters
@@ -311,13 +507,27 @@ int main(int argc, char* argv[]) {
   assignTranscripts(argv[2], inputList);
   printf("Assign transcripts is done!\n");
 
-  // parse alignments
-  parseAlignments(argv[2], 0);
-  printf("parseAlignments for '-' is done!\n");
-  parseAlignments(argv[3], 1);
-  printf("parseAlignments for '+' is done!\n");
+  // parse alignments, the two channels' BAM files are read concurrently since alignments only touch their own channel's data
+  ParseParams parseParams[2];
+  for (int i = 0; i < 2; ++i) {
+    parseParams[i].inpF = argv[2 + i];
+    parseParams[i].channel = i;
+  }
+  if (nthreads > 1) {
+    for (int i = 0; i < 2; ++i) {
+      rc = pthread_create(&threads[i], &attr, parseAlignments, (void*)(&parseParams[i]));
+      pthread_assert(rc, "pthread_create", "Cannot create thread " + itos(i) + " (numbered from 0) for parseAlignments!");
+    }
+    for (int i = 0; i < 2; ++i) {
+      rc = pthread_join(threads[i], NULL);
+      pthread_assert(rc, "pthread_join", "Cannot join thread " + itos(i) + " (numbered from 0) for parseAlignments!");
+    }
+  }
+  else 
+    for (int i = 0; i < 2; ++i) parseAlignments(&parseParams[i]);
 
-  // Run EM
+  // Run EM, results are written while transcripts converge
+  openOutputs(argv[4]);
   for (int i = 0; i < nthreads; ++i) {
     rc = pthread_create(&threads[i], &attr, runEM, (void*)(&transvec[i]));
     pthread_assert(rc, "pthread_create", "Cannot create thread " + itos(i) + " (numbered from 0)!");
@@ -327,9 +537,10 @@ int main(int argc, char* argv[]) {
     pthread_assert(rc, "pthread_join", "Cannot join thread " + itos(i) + " (numbered from 0)!");
   }
   printf("Run EM is done!\n");
+  reportRounds(argv[4]);
 
   // output
-  writeItOut(argv[4]);
+  closeOutputs(argv[4]);
   printf("Results are written!\n");
 
   // release resource
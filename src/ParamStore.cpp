@@ -0,0 +1,117 @@
+#include<cstdio>
+#include<cstring>
+#include<cassert>
+#include<string>
+#include<fstream>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+
+#include "utils.h"
+#include "my_assert.h"
+#include "ParamStore.hpp"
+
+const char ParamStore::MAGIC[8] = {'P', 'R', 'O', 'B', 'E', 'R', 'P', 'S'};
+
+ParamStore::ParamStore(const char* fileName) {
+  struct stat st;
+
+  fd = open(fileName, O_RDONLY);
+  general_assert(fd >= 0, "Cannot open parameter store " + cstrtos(fileName) + "!");
+  general_assert(fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ParamStoreHeader), cstrtos(fileName) + " is not a parameter store!");
+  size = st.st_size;
+
+  void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  general_assert(addr != MAP_FAILED, "Cannot map parameter store " + cstrtos(fileName) + "!");
+  base = (const char*)addr;
+
+  header = (const ParamStoreHeader*)base;
+  general_assert(!memcmp(header->magic, MAGIC, sizeof(MAGIC)) && header->version == VERSION, cstrtos(fileName) + " is not a parameter store of version " + itos(VERSION) + "!");
+  index = (const ParamStoreEntry*)(base + sizeof(ParamStoreHeader));
+  names = base + header->names_offset;
+}
+
+ParamStore::~ParamStore() {
+  munmap((void*)base, size);
+  close(fd);
+}
+
+bool ParamStore::isParamStore(const char* fileName) {
+  char magic[sizeof(MAGIC)];
+  FILE *fi = fopen(fileName, "rb");
+
+  if (fi == NULL) return false;
+  bool res = fread(magic, 1, sizeof(MAGIC), fi) == sizeof(MAGIC) && !memcmp(magic, MAGIC, sizeof(MAGIC));
+  fclose(fi);
+
+  return res;
+}
+
+void ParamStore::pwriteAll(int fd, const void* buf, size_t bytes, uint64_t offset) {
+  const char *p = (const char*)buf;
+  ssize_t n;
+
+  while (bytes > 0) {
+    n = pwrite(fd, p, bytes, offset);
+    general_assert(n > 0, "Cannot write the parameter store!");
+    p += n; bytes -= n; offset += n;
+  }
+}
+
+const char* ParamStore::get_channel_string(int channel) const {
+  return channelStr[(channel == 0 && hasControl()) ? 0 : 1];
+}
+
+void ParamStore::writeArrays(const char* fileName, int channel) const {
+  std::ofstream fout(fileName);
+  assert(fout.is_open());
+
+  fout.precision(10);
+  fout.unsetf(std::ios::floatfield);
+
+  fout<< header->M<< std::endl;
+  for (int i = 1; i <= header->M; ++i) {
+    const double *values = getArray(i, channel);
+    fout<< getName(i)<< '\t'<< getLen(i);
+    for (int j = 0; j < getLen(i); ++j) fout<< '\t'<< values[j];
+    fout<< std::endl;
+  }
+
+  fout.close();
+}
+
+void ParamStore::writeTheta(const char* fileName, int channel) const {
+  const double *theta = getTheta(channel);
+  std::ofstream fout(fileName);
+  assert(fout.is_open());
+
+  fout.precision(10);
+  fout.unsetf(std::ios::floatfield);
+
+  fout<< header->M<< std::endl;
+  fout<< theta[0];
+  for (int i = 1; i <= header->M; ++i) fout<< '\t'<< theta[i];
+  fout<< std::endl;
+
+  fout.close();
+}
+
+void ParamStore::writeText(const char* output_name, const char* statName) const {
+  char outF[STRLEN];
+
+  if (hasArray(0)) {
+    sprintf(outF, "%s.%s", output_name, hasControl() ? "gamma" : "beta");
+    writeArrays(outF, 0);
+  }
+  if (hasArray(1)) {
+    sprintf(outF, "%s.beta", output_name);
+    writeArrays(outF, 1);
+  }
+
+  for (int channel = 0; channel < 2; ++channel)
+    if (hasTheta(channel)) {
+      sprintf(outF, "%s_%s.theta", statName, get_channel_string(channel));
+      writeTheta(outF, channel);
+    }
+}
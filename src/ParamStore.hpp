@@ -0,0 +1,113 @@
+#ifndef PARAMSTORE_H_
+#define PARAMSTORE_H_
+
+#include<cassert>
+#include<string>
+#include<stdint.h>
+
+/*
+  Binary, indexed parameter store, an alternative to the text gamma/beta/theta files.
+
+  Layout of <sample_name>.params (host byte order):
+    ParamStoreHeader
+    ParamStoreEntry index[M + 1]       entry 0 is unused
+    double theta[2][M + 1]             same numbers as the .theta files, theta[c][0] is the noise probability, only present channels are stored
+    double values[]                    for each transcript, array 0 (gamma) then array 1 (beta), len values each, only present arrays are stored
+    char names[]                       '\0' terminated transcript names
+
+  Array/theta channel c is written as the text file write() would use for it, i.e. array 0 is '.beta' and
+  theta 0 is '_plus.theta' if there is no control. The file is mapped with mmap, so each transcript's
+  parameters are available in O(1) without parsing.
+ */
+
+struct ParamStoreHeader {
+  char magic[8]; // "PROBERPS"
+  int32_t version;
+  int32_t M; // number of transcripts
+  int32_t flags; // see PS_* below
+  int32_t reserved;
+  uint64_t theta_offset, names_offset; // offsets in bytes from the beginning of the file
+};
+
+struct ParamStoreEntry {
+  uint64_t offset; // offset in bytes of this transcript's first array
+  int32_t len; // number of values per array
+  uint32_t name_offset; // offset of the name in the names section
+};
+
+const int PS_HAS_CONTROL = 1;
+const int PS_ARRAY0 = 2, PS_ARRAY1 = 4; // which arrays are stored
+const int PS_THETA0 = 8, PS_THETA1 = 16; // which theta vectors are stored
+
+class ParamStore {
+public:
+  /*
+    @param   fileName   a parameter store file, mapped read only
+   */
+  ParamStore(const char* fileName);
+  ~ParamStore();
+
+  /*
+    @return   true if fileName exists and starts with the parameter store magic
+   */
+  static bool isParamStore(const char* fileName);
+
+  int getM() const { return header->M; }
+  bool hasControl() const { return header->flags & PS_HAS_CONTROL; }
+  bool hasArray(int channel) const { return header->flags & (channel == 0 ? PS_ARRAY0 : PS_ARRAY1); }
+  bool hasTheta(int channel) const { return header->flags & (channel == 0 ? PS_THETA0 : PS_THETA1); }
+
+  const char* getName(int tid) const { assert(tid > 0 && tid <= header->M); return names + index[tid].name_offset; }
+  int getLen(int tid) const { assert(tid > 0 && tid <= header->M); return index[tid].len; }
+
+  /*
+    @return   the len values of gamma (channel 0) or beta (channel 1) of transcript tid, i.e. positions 1 .. len
+   */
+  const double* getArray(int tid, int channel) const {
+    assert(tid > 0 && tid <= header->M && hasArray(channel));
+    const double *values = (const double*)(base + index[tid].offset);
+    return (channel == 1 && hasArray(0)) ? values + index[tid].len : values;
+  }
+
+  /*
+    @return   M + 1 theta values of a channel, as in the .theta files
+   */
+  const double* getTheta(int channel) const {
+    assert(hasTheta(channel));
+    return (const double*)(base + header->theta_offset) + ((channel == 1 && hasTheta(0)) ? header->M + 1 : 0);
+  }
+
+  /*
+    @param   output_name   the prefix of .gamma/.beta files
+    @param   statName      the prefix of .theta files
+    @comment: write the text files PROBerWholeModel::write would have written
+   */
+  void writeText(const char* output_name, const char* statName) const;
+
+  /*
+    @param   fd       file descriptor opened for writing
+    @param   buf      data to write
+    @param   bytes    number of bytes
+    @param   offset   file offset
+    @comment: pwrite until all bytes are written, safe to call from several threads on the same fd
+   */
+  static void pwriteAll(int fd, const void* buf, size_t bytes, uint64_t offset);
+
+  static const char MAGIC[8];
+  static const int VERSION = 1;
+
+private:
+  int fd;
+  size_t size;
+  const char *base;
+
+  const ParamStoreHeader *header;
+  const ParamStoreEntry *index;
+  const char *names;
+
+  const char* get_channel_string(int channel) const;
+  void writeArrays(const char* fileName, int channel) const;
+  void writeTheta(const char* fileName, int channel) const;
+};
+
+#endif
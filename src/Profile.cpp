@@ -31,6 +31,7 @@ Profile::Profile(int maxL) {
   size = proLen * NCODES * NCODES;
   p = new double[proLen][NCODES][NCODES];
   memset(p, 0, sizeof(double) * size);
+  logp = new double[proLen][NCODES][NCODES];
   
   //set initial parameters
   int N = NCODES - 1;
@@ -51,12 +52,14 @@ Profile::Profile(int maxL) {
     for (int k = 0; k < NCODES - 1; ++k)
       p[i][N][k] = (1.0 - probN) / (NCODES - 1);
   }
+  calcLogTable();
 
   pc = NULL;
 }
 
 Profile::~Profile() { 
   delete[] p;
+  delete[] logp;
 }
 
 void Profile::init() {
@@ -81,6 +84,8 @@ void Profile::finish() {
       else for (int k = 0; k < NCODES; ++k) p[i][j][k] /= sum;
     }
   }
+
+  calcLogTable();
 }
 
 void Profile::read(std::ifstream& fin) {
@@ -96,10 +101,12 @@ void Profile::read(std::ifstream& fin) {
 
   if (tmp_prolen != proLen) {
     delete[] p;
+    delete[] logp;
     proLen = tmp_prolen;
     size = proLen * NCODES * NCODES;
     p = new double[proLen][NCODES][NCODES];
     memset(p, 0, sizeof(double) * size);
+    logp = new double[proLen][NCODES][NCODES];
   }
   
   for (int i = 0; i < proLen; ++i)
@@ -108,6 +115,8 @@ void Profile::read(std::ifstream& fin) {
 	assert(fin>> p[i][j][k]);
 
   getline(fin, line);
+
+  calcLogTable();
 }
 
 void Profile::write(std::ofstream& fout) {
@@ -124,6 +133,12 @@ void Profile::write(std::ofstream& fout) {
   }
 }
 
+void Profile::calcLogTable() {
+  const double *src = (const double*)p;
+  double *dest = (double*)logp;
+  for (int i = 0; i < size; ++i) dest[i] = safeLog(src[i]);
+}
+
 void Profile::startSimulation() {
   pc = new double[proLen][NCODES][NCODES];
 
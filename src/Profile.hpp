@@ -35,14 +35,40 @@ public:
     return p[pos][ref_base][read_base];
   }
 
+  double getLogProb(int pos, int ref_base, int read_base) const {
+    return logp[pos][ref_base][read_base];
+  }
+
   void update(int pos, int ref_base, int read_base, double frac) {
     p[pos][ref_base][read_base] += frac;
   }
 
+  /*
+    @param   pos          position of the first base in the read
+    @param   n            number of consecutive bases
+    @param   ref_codes    reference base codes
+    @param   read_codes   read base codes
+    @return  sum of log p[pos + i][ref_codes[i]][read_codes[i]], i = 0 .. n - 1
+   */
+  double sumLogProbs(int pos, int n, const uint8_t* ref_codes, const uint8_t* read_codes) const {
+    const double *lp = logp[pos][0];
+    double sum[4] = {0.0, 0.0, 0.0, 0.0}; // independent partial sums, so that the gathers are not serialized by one add chain
+    int i = 0;
+    for (; i + 4 <= n; i += 4, lp += 4 * NCODES * NCODES)
+      for (int k = 0; k < 4; ++k) sum[k] += lp[k * NCODES * NCODES + ref_codes[i + k] * NCODES + read_codes[i + k]];
+    for (; i < n; ++i, lp += NCODES * NCODES) sum[0] += lp[ref_codes[i] * NCODES + read_codes[i]];
+    return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+  }
+
   void init();
   void collect(const Profile* o);
   void finish(); // No pseudo-count here. However, if we assume Illumina platform and the read length difference is due to trimming, it should be fine.
 
+  // append all probabilities to params, used to measure how much the profile changes between EM rounds
+  void appendParams(std::vector<double>& params) const {
+    params.insert(params.end(), (const double*)p, (const double*)p + size);
+  }
+
   void read(std::ifstream& fin);
   void write(std::ofstream& fout);
 
@@ -59,8 +85,11 @@ private:
   int proLen; // profile length
   int size; // # of items in p;
   double (*p)[NCODES][NCODES]; //profile matrices
+  double (*logp)[NCODES][NCODES]; // log of p, refreshed whenever p is finished or read
   
   double (*pc)[NCODES][NCODES]; // for simulation
+
+  void calcLogTable();
 };
 
 #endif /* PROFILE_H_ */
@@ -41,6 +41,8 @@ QProfile::QProfile() {
     for (int k = 0; k < NCODES - 1; ++k)
       p[i][N][k] = (1.0 - probN) / (NCODES - 1);
   }
+
+  calcLogTable();
 }
 
 void QProfile::init() {
@@ -65,6 +67,8 @@ void QProfile::finish() {
       else for (int k = 0; k < NCODES; ++k) p[i][j][k] /= sum;
     }
   }
+
+  calcLogTable();
 }
 
 void QProfile::read(std::ifstream& fin) {
@@ -84,6 +88,8 @@ void QProfile::read(std::ifstream& fin) {
 	assert(fin>> p[i][j][k]);
 
   getline(fin, line);
+
+  calcLogTable();
 }
 
 void QProfile::write(std::ofstream& fout) {
@@ -99,6 +105,12 @@ void QProfile::write(std::ofstream& fout) {
   }
 }
 
+void QProfile::calcLogTable() {
+  const double *src = (const double*)p;
+  double *dest = (double*)logp;
+  for (int i = 0; i < SIZE * NCODES * NCODES; ++i) dest[i] = safeLog(src[i]);
+}
+
 void QProfile::startSimulation() {
   pc = new double[SIZE][NCODES][NCODES];
 
@@ -16,13 +16,39 @@ public:
     return p[qual][ref_base][read_base];
   }
 
+  double getLogProb(int qual, int ref_base, int read_base) const {
+    return logp[qual][ref_base][read_base];
+  }
+
   void update(int qual, int ref_base, int read_base, double frac) {
     p[qual][ref_base][read_base] += frac;
   }
 
+  /*
+    @param   n            number of bases
+    @param   quals        quality scores, 33 is already deducted
+    @param   ref_codes    reference base codes
+    @param   read_codes   read base codes
+    @return  sum of log p[quals[i]][ref_codes[i]][read_codes[i]], i = 0 .. n - 1
+   */
+  double sumLogProbs(int n, const uint8_t* quals, const uint8_t* ref_codes, const uint8_t* read_codes) const {
+    const double *lp = logp[0][0];
+    double sum[4] = {0.0, 0.0, 0.0, 0.0}; // independent partial sums, so that the gathers are not serialized by one add chain
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+      for (int k = 0; k < 4; ++k) sum[k] += lp[(quals[i + k] * NCODES + ref_codes[i + k]) * NCODES + read_codes[i + k]];
+    for (; i < n; ++i) sum[0] += lp[(quals[i] * NCODES + ref_codes[i]) * NCODES + read_codes[i]];
+    return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+  }
+
   void init();
   void collect(const QProfile* o);
   void finish();
+
+  // append all probabilities to params, used to measure how much the profile changes between EM rounds
+  void appendParams(std::vector<double>& params) const {
+    params.insert(params.end(), (const double*)p, (const double*)p + SIZE * NCODES * NCODES);
+  }
     
   void read(std::ifstream& fin);
   void write(std::ofstream& fout);
@@ -39,8 +65,11 @@ private:
   static const int SIZE = 100;
   
   double p[SIZE][NCODES][NCODES]; // p[q][r][c] = p(c|r,q)
+  double logp[SIZE][NCODES][NCODES]; // log of p, refreshed whenever p is finished or read
   
   double (*pc)[NCODES][NCODES]; // for simulation
+
+  void calcLogTable();
 };
 
 #endif /* QPROFILE_H_ */
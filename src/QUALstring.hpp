@@ -2,6 +2,7 @@
 #define QUALSTRING_H_
 
 #include<cassert>
+#include<cstring>
 #include<string>
 #include<sstream>
 
@@ -40,6 +41,14 @@ public:
     return qual[return_current ? pos : len - pos - 1];
   }
 
+  // Copy n quality scores starting from pos into out, same as calling qualAt n times
+  void quals(int pos, int n, uint8_t* out) const {
+    assert(pos >= 0 && n >= 0 && pos + n <= len);
+    if (return_current) memcpy(out, qual + pos, n);
+    else
+      for (int i = 0, rpos = len - pos - 1; i < n; ++i) out[i] = qual[rpos - i];
+  }
+
   // default is the original quality score string
   std::string toString(char dir = '+') {
     setDir(dir);
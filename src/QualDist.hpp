@@ -14,12 +14,12 @@ class QualDist {
 public:
   QualDist();
   
-  void update(const QUALstring& qual) {
+  void update(const QUALstring& qual, int count = 1) {
     int len = qual.getLen();
 
-    ++p_init[qual.qualAt(0)];
+    p_init[qual.qualAt(0)] += count;
     for (int i = 1; i < len; ++i) {
-      ++p_tran[qual.qualAt(i - 1)][qual.qualAt(i)];
+      p_tran[qual.qualAt(i - 1)][qual.qualAt(i)] += count;
     }
   }
 
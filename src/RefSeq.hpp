@@ -58,6 +58,15 @@ public:
     return (dir == '+' ? base2code[seq[pos]] : rbase2code[seq[len - pos - 1]]);
   }
 
+  // Decode n base codes starting from pos of strand dir into out, same as calling baseCodeAt n times
+  void baseCodes(char dir, int pos, int n, uint8_t* out) const {
+    assert(pos >= 0 && n >= 0 && pos + n <= len);
+    if (dir == '+')
+      for (int i = 0; i < n; ++i) out[i] = base2code[seq[pos + i]];
+    else
+      for (int i = 0, rpos = len - pos - 1; i < n; ++i) out[i] = rbase2code[seq[rpos - i]];
+  }
+
   void setUp(char dir, CIGARstring& cigar, MDstring& mdstr, SEQstring& seq);
   
 private:
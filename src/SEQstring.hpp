@@ -43,6 +43,15 @@ public:
     return (return_current ? codes[bam_seqi(seq, pos)] : rcodes[bam_seqi(seq, len - pos - 1)]);
   }
 
+  // Decode n base codes starting from pos into out, same as calling baseCodeAt n times
+  void baseCodes(int pos, int n, uint8_t* out) const {
+    assert(pos >= 0 && n >= 0 && pos + n <= len);
+    if (return_current)
+      for (int i = 0; i < n; ++i) out[i] = codes[bam_seqi(seq, pos + i)];
+    else
+      for (int i = 0, rpos = len - pos - 1; i < n; ++i) out[i] = rcodes[bam_seqi(seq, rpos - i)];
+  }
+
   // toString will reset dir
   std::string toString(char dir = '+');
 
@@ -3,7 +3,11 @@
 
 #include<cmath>
 #include<cassert>
+#include<cstring>
 #include<fstream>
+#include<vector>
+#include<algorithm>
+#include<stdint.h>
 
 #include "RefSeq.hpp"
 #include "CIGARstring.hpp"
@@ -24,18 +28,62 @@
  * with insert size. Thus we choose the second interpretation.
  */
 
+/*
+  Read-side quantities of one mate, shared by all alignments of the read. Filled by SequencingModel::setUpRead
+  and only valid until the sequencing model changes.
+ */
+struct ReadCache {
+  char dir; // the strand all alignments of this mate are on
+  int len; // read length
+  std::vector<uint8_t> codes, quals; // base codes and quality scores, in read order
+  std::vector<char> fwd; // the bases the reference's forward strand would have if every base matched
+  std::vector<double> matchLogP; // log probability of each base being sequenced correctly, in read order
+  std::vector<double> insLogP; // log probability of each base being an inserted base, in read order
+
+  // the last CIGAR seen and the log probability of the read on it if every aligned base matched
+  std::vector<uint32_t> cigar; // (oplen << 8) | opchr
+  double cigarLogP;
+};
+
 class SequencingModel {
 public:
   SequencingModel(bool hasQual, int maxL = 1000);
   ~SequencingModel();
 
   double getProb(char dir, int pos, const RefSeq* refseq, const CIGARstring* cigar, const SEQstring* seq, const QUALstring* qual = NULL);
+  double getLogProb(char dir, int pos, const RefSeq* refseq, const CIGARstring* cigar, const SEQstring* seq, const QUALstring* qual = NULL);
+
+  /*
+    @param   dir     '+' or '-', the strand of all alignments of this mate
+    @param   seq     read sequence
+    @param   qual    quality score string
+    @param   rc      filled with the decoded read and its per-base log probabilities
+   */
+  void setUpRead(char dir, const SEQstring* seq, const QUALstring* qual, ReadCache& rc) const;
+
+  /*
+    @param   pos      position in rc.dir strand, 0-based
+    @param   refseq   reference sequence in '+' strand
+    @param   cigar    cigar string
+    @param   rc       the read, set up by setUpRead
+    @return  the same value as getLogProb, up to rounding
+    @comment: the all-match log probability is reused while consecutive alignments share a CIGAR, then only mismatching bases,
+              found by comparing the reference with rc.fwd 8 bytes at a time, are corrected
+   */
+  double getLogProb(int pos, const RefSeq* refseq, const CIGARstring* cigar, ReadCache& rc) const;
   void update(double frac, char dir, int pos, const RefSeq* refseq, const CIGARstring* cigar, const SEQstring* seq, const QUALstring* qual = NULL);
 
   void init();
   void collect(const SequencingModel* o);
   void finish();
 
+  // append all probabilities to params, used to measure how much the model changes between EM rounds
+  void appendParams(std::vector<double>& params) const {
+    markov->appendParams(params);
+    if (hasQual) qprofile->appendParams(params);
+    else profile->appendParams(params);
+  }
+
   void read(std::ifstream& fin);
   void write(std::ofstream& fout);
 
@@ -51,6 +99,11 @@ private:
   Profile *profile;
   QProfile *qprofile;
 
+  // log probability of the read base at readpos being sequenced as read_code from ref_code
+  double baseLogProb(const ReadCache& rc, int readpos, int ref_code, int read_code) const {
+    return hasQual ? qprofile->getLogProb(rc.quals[readpos], ref_code, read_code) : profile->getLogProb(readpos, ref_code, read_code);
+  }
+
   void push(std::string& cigar, char opchr, int oplen) {
     int s = 0;
     char arr[50];
@@ -71,34 +124,49 @@ private:
   @return  probability of generating such a read
  */
 inline double SequencingModel::getProb(char dir, int pos, const RefSeq* refseq, const CIGARstring* cigar, const SEQstring* seq, const QUALstring* qual) {
-  double prob = 1.0;
+  return exp(getLogProb(dir, pos, refseq, cigar, seq, qual));
+}
+
+/*
+  @return  log probability of generating such a read, LOG_ZERO or below if it is impossible
+  @comment: Parameters are the same as getProb. Aligned bases are decoded CHUNK at a time and summed over the 
+            log tables of profile/qprofile, which are refreshed once per read model update.
+ */
+inline double SequencingModel::getLogProb(char dir, int pos, const RefSeq* refseq, const CIGARstring* cigar, const SEQstring* seq, const QUALstring* qual) {
+  const int CHUNK = 64;
+  uint8_t ref_codes[CHUNK], read_codes[CHUNK], quals[CHUNK];
+
+  double logprob = 0.0;
   int len = cigar->getLen();
   int readpos = 0;
 
   char opchr, last_opchr = 0;
-  int oplen;
-
-  int ref_base, read_base;
+  int oplen, n;
 
   for (int i = 0; i < len; ++i) {
     opchr = cigar->opchrAt(i);
     oplen = cigar->oplenAt(i);
 
     // Markov model probabilities
-    prob *= (last_opchr == 0 ? markov->getProb(opchr) : markov->getProb(last_opchr, opchr));
-    if (oplen > 1) prob *= pow(markov->getProb(opchr, opchr), oplen - 1);
+    logprob += (last_opchr == 0 ? markov->getLogProb(opchr) : markov->getLogProb(last_opchr, opchr));
+    if (oplen > 1) logprob += markov->getLogProb(opchr, opchr) * (oplen - 1);
 
     if (opchr == 'M' || opchr == '=' || opchr == 'X') {
-      for (int j = 0; j < oplen; ++j) {
-	ref_base = refseq->baseCodeAt(dir, pos);
-	read_base = seq->baseCodeAt(readpos);
-	prob *= (hasQual ? qprofile->getProb(qual->qualAt(readpos), ref_base, read_base) : profile->getProb(readpos, ref_base, read_base));
-	++pos; ++readpos;
+      for (int j = 0; j < oplen; j += n) {
+	n = std::min(CHUNK, oplen - j);
+	refseq->baseCodes(dir, pos + j, n, ref_codes);
+	seq->baseCodes(readpos + j, n, read_codes);
+	if (hasQual) {
+	  qual->quals(readpos + j, n, quals);
+	  logprob += qprofile->sumLogProbs(n, quals, ref_codes, read_codes);
+	}
+	else logprob += profile->sumLogProbs(readpos + j, n, ref_codes, read_codes);
       }
+      pos += oplen; readpos += oplen;
     }
     else if (opchr == 'I') {
       for (int j = 0; j < oplen; ++j) {
-	prob *= markov->getIBaseProb(seq->baseCodeAt(readpos));
+	logprob += markov->getIBaseLogProb(seq->baseCodeAt(readpos));
 	++readpos;
       }
     }
@@ -110,7 +178,108 @@ inline double SequencingModel::getProb(char dir, int pos, const RefSeq* refseq,
     last_opchr = opchr;
   }
 
-  return prob;
+  return logprob;
+}
+
+inline void SequencingModel::setUpRead(char dir, const SEQstring* seq, const QUALstring* qual, ReadCache& rc) const {
+  int len = seq->getLen();
+
+  assert(len > 0);
+  rc.dir = dir;
+  rc.len = len;
+  rc.codes.resize(len); rc.fwd.resize(len);
+  rc.matchLogP.resize(len); rc.insLogP.resize(len);
+  seq->baseCodes(0, len, &rc.codes[0]);
+  if (hasQual) {
+    rc.quals.resize(len);
+    qual->quals(0, len, &rc.quals[0]);
+  }
+
+  for (int i = 0; i < len; ++i) {
+    int code = rc.codes[i];
+    rc.matchLogP[i] = baseLogProb(rc, i, code, code);
+    rc.insLogP[i] = markov->getIBaseLogProb(code);
+    // a '-' strand read runs backwards on the forward strand and matches the complement
+    if (dir == '+') rc.fwd[i] = code2base[code];
+    else rc.fwd[len - i - 1] = code2base[code < 4 ? 3 - code : code];
+  }
+
+  rc.cigar.clear();
+  rc.cigarLogP = 0.0;
+}
+
+inline double SequencingModel::getLogProb(int pos, const RefSeq* refseq, const CIGARstring* cigar, ReadCache& rc) const {
+  int len = cigar->getLen();
+  int readpos, oplen;
+  char opchr, last_opchr;
+  bool same = ((int)rc.cigar.size() == len);
+
+  for (int i = 0; same && i < len; ++i)
+    same = rc.cigar[i] == (((uint32_t)cigar->oplenAt(i) << 8) | (uint8_t)cigar->opchrAt(i));
+
+  // read side, assuming all aligned bases match
+  if (!same) {
+    rc.cigar.resize(len);
+    rc.cigarLogP = 0.0;
+    readpos = 0; last_opchr = 0;
+    for (int i = 0; i < len; ++i) {
+      opchr = cigar->opchrAt(i);
+      oplen = cigar->oplenAt(i);
+      rc.cigar[i] = ((uint32_t)oplen << 8) | (uint8_t)opchr;
+
+      rc.cigarLogP += (last_opchr == 0 ? markov->getLogProb(opchr) : markov->getLogProb(last_opchr, opchr));
+      if (oplen > 1) rc.cigarLogP += markov->getLogProb(opchr, opchr) * (oplen - 1);
+
+      if (opchr == 'M' || opchr == '=' || opchr == 'X') {
+	for (int j = 0; j < oplen; ++j) rc.cigarLogP += rc.matchLogP[readpos + j];
+	readpos += oplen;
+      }
+      else if (opchr == 'I') {
+	for (int j = 0; j < oplen; ++j) rc.cigarLogP += rc.insLogP[readpos + j];
+	readpos += oplen;
+      }
+      else assert(opchr == 'D');
+
+      last_opchr = opchr;
+    }
+  }
+
+  // reference side, correct the mismatches
+  double logprob = rc.cigarLogP;
+  const char *fwdref = refseq->getSeq().data();
+  int reflen = refseq->getLen();
+  uint64_t a, b;
+
+  readpos = 0;
+  for (int i = 0; i < len; ++i) {
+    opchr = cigar->opchrAt(i);
+    oplen = cigar->oplenAt(i);
+
+    if (opchr == 'M' || opchr == '=' || opchr == 'X') {
+      // the run on the forward strand
+      assert(pos >= 0 && pos + oplen <= reflen);
+      const char *ref = fwdref + (rc.dir == '+' ? pos : reflen - pos - oplen);
+      const char *read = &rc.fwd[0] + (rc.dir == '+' ? readpos : rc.len - readpos - oplen);
+      for (int j = 0; j < oplen; j += 8) {
+	int n = std::min(8, oplen - j);
+	if (n == 8) {
+	  memcpy(&a, ref + j, 8); memcpy(&b, read + j, 8);
+	  if (a == b) continue;
+	}
+	for (int k = j; k < j + n; ++k) if (ref[k] != read[k]) {
+	  int rpos = (rc.dir == '+' ? readpos + k : readpos + oplen - k - 1);
+	  int read_code = rc.codes[rpos];
+	  int ref_code = (rc.dir == '+' ? base2code[ref[k]] : rbase2code[ref[k]]);
+	  logprob += baseLogProb(rc, rpos, ref_code, read_code) - rc.matchLogP[rpos];
+	}
+      }
+      pos += oplen; readpos += oplen;
+    }
+    else if (opchr == 'I') readpos += oplen;
+    else pos += oplen;
+  }
+
+  return logprob;
 }
 
 /*
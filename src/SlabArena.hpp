@@ -0,0 +1,64 @@
+#ifndef SLABARENA_H_
+#define SLABARENA_H_
+
+#include<cstdlib>
+#include<cassert>
+
+#include "my_assert.h"
+
+/*
+  A bump allocator for per transcript arrays. Array sizes are first registered with reserve(),
+  then allocate() gets a single 64-byte aligned slab and alloc() carves arrays from it in the
+  same order. Every array starts on its own cache line. All arrays are released together when
+  the arena is destroyed, individual arrays must not be deleted.
+ */
+class SlabArena {
+public:
+  SlabArena() : slab(NULL), capacity(0), used(0) {}
+
+  ~SlabArena() {
+    if (slab != NULL) free(slab);
+  }
+
+  /*
+    @param   n   number of doubles
+    @comment: reserve room for an array of n doubles, call before allocate()
+   */
+  void reserve(size_t n) {
+    assert(slab == NULL);
+    capacity += roundUp(sizeof(double) * n);
+  }
+
+  /*
+    @comment: allocate the slab for all reserved arrays
+   */
+  void allocate() {
+    assert(slab == NULL);
+    if (capacity == 0) return;
+    general_assert(posix_memalign(&slab, ALIGNMENT, capacity) == 0, "Cannot allocate " + itos(capacity >> 20) + " MB for the slab arena!");
+  }
+
+  /*
+    @param   n   number of doubles
+    @return  an uninitialized, 64-byte aligned array of n doubles
+   */
+  double* alloc(size_t n) {
+    size_t bytes = roundUp(sizeof(double) * n);
+    assert(slab != NULL && used + bytes <= capacity);
+    double *arr = (double*)((char*)slab + used);
+    used += bytes;
+    return arr;
+  }
+
+private:
+  static const size_t ALIGNMENT = 64; // cache line size
+
+  void *slab;
+  size_t capacity, used; // in bytes
+
+  static size_t roundUp(size_t bytes) {
+    return (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+  }
+};
+
+#endif
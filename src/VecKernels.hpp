@@ -0,0 +1,113 @@
+#ifndef VECKERNELS_H_
+#define VECKERNELS_H_
+
+#include<cmath>
+#include<cstring>
+
+/*
+  Loop kernels used by PROBerTransModel::calcAuxiliaryArrays. Each kernel is a straight loop without
+  loop-carried dependencies (except prefixSum), so that the compiler can vectorize it together with
+  the vectorized log/exp from libmvec (enabled by -ffast-math). With GCC on x86-64, an AVX2 clone
+  and a baseline clone are built for every kernel and the right one is chosen at runtime.
+ */
+
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__)
+#define VEC_TARGET_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define VEC_TARGET_CLONES
+#endif
+
+namespace VecKernels {
+
+/*
+  @param   n       number of positions
+  @param   gamma   gamma values
+  @param   out     out[i] = log(1 - gamma[i]), or -inf_value if gamma[i] >= 1
+ */
+VEC_TARGET_CLONES
+static void logPass(int n, const double* gamma, double inf_value, double* out) {
+  for (int i = 0; i < n; ++i)
+    out[i] = gamma[i] >= 1.0 ? -inf_value : log(1.0 - gamma[i]);
+}
+
+/*
+  @comment: same as above, out[i] = log(1 - gamma[i]) + log(1 - beta[i])
+ */
+VEC_TARGET_CLONES
+static void logPass(int n, const double* gamma, const double* beta, double inf_value, double* out) {
+  for (int i = 0; i < n; ++i)
+    out[i] = (gamma[i] >= 1.0 || beta[i] >= 1.0) ? -inf_value : log(1.0 - gamma[i]) + log(1.0 - beta[i]);
+}
+
+/*
+  @param   n     number of elements to scan
+  @param   arr   arr[i] += arr[i - 1] for i = 1 .. n - 1, in place
+  @comment: Long arrays are scanned as four blocks with independent dependency chains, then the
+            block offsets are added back in a vectorizable pass.
+ */
+static void prefixSum(int n, double* arr) {
+  const int NBLOCKS = 4;
+  int blen = n / NBLOCKS;
+
+  if (blen < 64) {
+    for (int i = 1; i < n; ++i) arr[i] += arr[i - 1];
+    return;
+  }
+
+  double *b0 = arr, *b1 = arr + blen, *b2 = arr + 2 * blen, *b3 = arr + 3 * blen;
+  for (int k = 1; k < blen; ++k) {
+    b0[k] += b0[k - 1]; b1[k] += b1[k - 1]; b2[k] += b2[k - 1]; b3[k] += b3[k - 1];
+  }
+  for (int j = 1; j < NBLOCKS; ++j) {
+    double offset = arr[j * blen - 1];
+    double *b = arr + j * blen;
+    for (int k = 0; k < blen; ++k) b[k] += offset;
+  }
+  for (int i = NBLOCKS * blen; i < n; ++i) arr[i] += arr[i - 1];
+}
+
+/*
+  @param   n      number of positions
+  @param   ncut   out[i] = exp(hi[i] - lo[i]) for i < ncut, and 0 otherwise
+ */
+VEC_TARGET_CLONES
+static void expDiff(int n, int ncut, const double* hi, const double* lo, double* out) {
+  if (ncut > n) ncut = n;
+  if (ncut < 0) ncut = 0;
+  for (int i = 0; i < ncut; ++i) out[i] = exp(hi[i] - lo[i]);
+  if (ncut < n) memset(out + ncut, 0, sizeof(double) * (n - ncut));
+}
+
+/*
+  @return   mp[0] * exp(hi[0] - lo[0]) + \sum_{i = 1}^{n - 1} mp[i] * exp(hi[i] - lo[i]) * gamma[i]
+ */
+VEC_TARGET_CLONES
+static double sumEndProbs(int n, const double* mp, const double* hi, const double* lo, const double* gamma) {
+  double sum = 0.0;
+  for (int i = 1; i < n; ++i) sum += mp[i] * exp(hi[i] - lo[i]) * gamma[i];
+  return sum + mp[0] * exp(hi[0] - lo[0]);
+}
+
+/*
+  @return   same as above, but the drop-off probability is gamma[i] + beta[i] - gamma[i] * beta[i]
+ */
+VEC_TARGET_CLONES
+static double sumEndProbs(int n, const double* mp, const double* hi, const double* lo, const double* gamma, const double* beta) {
+  double sum = 0.0;
+  for (int i = 1; i < n; ++i) sum += mp[i] * exp(hi[i] - lo[i]) * (gamma[i] + beta[i] - gamma[i] * beta[i]);
+  return sum + mp[0] * exp(hi[0] - lo[0]);
+}
+
+/*
+  @return   \sum_{i = 0}^{n - 1} d * log(x[i]) + c * log(1 - x[i]), the Beta prior's log density without its normalizing constant
+ */
+VEC_TARGET_CLONES
+static double sumLogBeta(int n, const double* x, double d, double c) {
+  double sum = 0.0;
+  for (int i = 0; i < n; ++i) sum += d * log(x[i]) + c * log(1.0 - x[i]);
+  return sum;
+}
+
+}
+
+#endif
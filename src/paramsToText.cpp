@@ -0,0 +1,51 @@
+#include<cstdio>
+#include<cstring>
+#include<cstdlib>
+#include<cassert>
+#include<string>
+
+#include "utils.h"
+#include "my_assert.h"
+
+#include "ParamStore.hpp"
+
+using namespace std;
+
+bool verbose = true; // define verbose
+
+char storeF[STRLEN], statName[STRLEN];
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    printf("Usage: PROBer-params-to-text sample_name [--stat-name stat_name]\n\n");
+    printf("Description:\n");
+    printf("  This program converts the binary parameter store 'sample_name.params' written by 'PROBer-run-em --binary-params' into the text gamma, beta and theta files.\n\n");
+    printf("Arguments:\n");
+    printf("  sample_name: The 'sample_name' used in 'PROBer-estimate-parameters'. No slash should be in the end of this string.\n");
+    printf("  [--stat-name stat_name]: Optional argument, the prefix of theta files, default is 'sample_name.stat/sample_name' with directories removed from the second 'sample_name'.\n");
+    return 0;
+  }
+
+  sprintf(storeF, "%s.params", argv[1]);
+
+  // generate statName as the wrapper does
+  string tmpStr = string(argv[1]);
+  size_t strpos = tmpStr.find_last_of('/');
+  if (strpos == string::npos) strpos = 0;
+  else strpos = strpos + 1;
+  assert(strpos < tmpStr.length());
+  sprintf(statName, "%s.stat/%s", argv[1], tmpStr.substr(strpos).c_str());
+
+  for (int i = 2; i < argc; ++i) {
+    if (!strcmp(argv[i], "--stat-name")) strcpy(statName, argv[i + 1]);
+    if (!strcmp(argv[i], "-q")) verbose = false;
+  }
+
+  general_assert(ParamStore::isParamStore(storeF), cstrtos(storeF) + " is not a parameter store!");
+  ParamStore store(storeF);
+  store.writeText(argv[1], statName);
+
+  if (verbose) printf("Converted %d transcripts from %s!\n", store.getM(), storeF);
+
+  return 0;
+}
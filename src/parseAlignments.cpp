@@ -6,6 +6,8 @@
 #include<vector>
 #include<fstream>
 #include<iostream>
+#include<utility>
+#include<unordered_map>
 
 
 #include "htslib/sam.h"
@@ -29,7 +31,7 @@ MyHeap my_heap; // a heap to record number of alignments contained in each parti
 
 char imdName[STRLEN], statName[STRLEN];
 char tiF[STRLEN], bamOutF[STRLEN], cntF[STRLEN];
-char paramsF[STRLEN], partitionF[STRLEN];
+char paramsF[STRLEN], partitionF[STRLEN], dupF[STRLEN];
 
 Transcripts transcripts;
 
@@ -49,6 +51,34 @@ bool bowtie_filter;
 int max_hit_allowed; // maximum number of alignments allowed
 int min_len; // minimum read length required
 
+// Duplicate collapsing: alignable reads with identical sequence, quality scores and alignments are written once, 
+// the names of the other copies are recorded in imdName_<partition>.dup as "read_index_in_partition\tname" lines
+typedef pair<uint64_t, uint64_t> DupKey; // two 64-bit FNV-1a hashes with different offset bases
+
+struct DupKeyHash {
+  size_t operator() (const DupKey& key) const { return key.first; }
+};
+
+struct DupEntry {
+  int id; // partition
+  READ_INT_TYPE rid; // index of the representative read in its partition
+};
+
+bool collapse_dups;
+unordered_map<DupKey, DupEntry, DupKeyHash> dup_table;
+vector<READ_INT_TYPE> part_nreads; // number of reads written to each partition
+vector<ofstream*> dupFs;
+READ_INT_TYPE nCollapsed;
+
+inline DupKey getDupKey(AlignmentGroup &ag) {
+  DupKey key(14695981039346656037ULL, 9650029242287828579ULL);
+  for (int i = 0; i < ag.size(); ++i) {
+    key.first = ag.getAlignment(i)->hash(key.first, i == 0);
+    key.second = ag.getAlignment(i)->hash(key.second, i == 0);
+  }
+  return key;
+}
+
 inline bool isGeneMultiRead(AlignmentGroup &ag) {
   int size = ag.size();
   if (size == 1) return false;
@@ -100,7 +130,7 @@ void writeStat(const char* statName) {
 
 int main(int argc, char* argv[]) {
   if (argc < 7) { 
-    printf("PROBer-parse-alignments refName imdName statName channel number_of_partitions alignF [-m max_hit_allowed][--shorter-than min_len] [-q]\n");
+    printf("PROBer-parse-alignments refName imdName statName channel number_of_partitions alignF [-m max_hit_allowed][--shorter-than min_len] [--collapse-duplicates] [-q]\n");
     exit(-1);
   }
 
@@ -116,11 +146,13 @@ int main(int argc, char* argv[]) {
   bowtie_filter = false;
   max_hit_allowed = 2147483647; // 2^31 - 1
   min_len = -1;
+  collapse_dups = false;
 
   for (int i = 7; i < argc; i++) {
     if (!strcmp(argv[i], "-q")) verbose = false;
     if (!strcmp(argv[i], "-m")) max_hit_allowed = atoi(argv[i + 1]);
     if (!strcmp(argv[i], "--shorter-than")) min_len = atoi(argv[i + 1]);
+    if (!strcmp(argv[i], "--collapse-duplicates")) collapse_dups = true;
   }
 
   parser = new SamParser(argv[6]);
@@ -143,6 +175,19 @@ int main(int argc, char* argv[]) {
   sprintf(bamOutF, "%s_N2.bam", imdName);
   writer2 = new BamWriter(bamOutF, NULL, "PROBer intermediate");
 
+  // PROBer-run-em collapses reads whenever a .dup file exists, so remove stale ones
+  part_nreads.assign(num_threads, 0);
+  dupFs.assign(num_threads, NULL);
+  nCollapsed = 0;
+  for (int i = 0; i < num_threads; i++) {
+    sprintf(dupF, "%s_%d.dup", imdName, i);
+    if (collapse_dups) {
+      dupFs[i] = new ofstream(dupF);
+      general_assert(dupFs[i]->is_open(), "Cannot create " + cstrtos(dupF) + "!");
+    }
+    else remove(dupF);
+  }
+
   memset(N, 0, sizeof(N));
   counts.clear();
   nUnique = nMulti = nIsoMulti = 0;
@@ -162,10 +207,24 @@ int main(int argc, char* argv[]) {
     else if (isAligned) {
       // Read is alignable
       ++N[1];
-      
-      int id = my_heap.getTop();
-      writers[id]->write(ag, 1); // remove seq and qual for secondary alignments
-      my_heap.updateTop(ag.size());
+
+      DupEntry *entry = NULL;
+      if (collapse_dups) {
+	pair<unordered_map<DupKey, DupEntry, DupKeyHash>::iterator, bool> res = dup_table.insert(make_pair(getDupKey(ag), DupEntry()));
+	if (!res.second) entry = &res.first->second;
+	else { res.first->second.id = my_heap.getTop(); res.first->second.rid = part_nreads[my_heap.getTop()]; }
+      }
+
+      if (entry != NULL) {
+	*dupFs[entry->id]<< entry->rid<< '\t'<< ag.getName()<< '\n';
+	++nCollapsed;
+      }
+      else {
+	int id = my_heap.getTop();
+	writers[id]->write(ag, 1); // remove seq and qual for secondary alignments
+	my_heap.updateTop(ag.size());
+	++part_nreads[id];
+      }
       
       // Multi-read stats
       if (isGeneMultiRead(ag)) ++nMulti;
@@ -193,6 +252,10 @@ int main(int argc, char* argv[]) {
   for (int i = 0; i < num_threads; i++) delete writers[i];
   delete writer0;
   delete writer2;
+  for (int i = 0; i < num_threads; i++) 
+    if (dupFs[i] != NULL) { dupFs[i]->close(); delete dupFs[i]; }
+
+  if (verbose && collapse_dups) cout<< nCollapsed<< " duplicate reads are collapsed into "<< N[1] - nCollapsed<< " alignable reads!"<< endl;
 
   writeStat(statName);
 
@@ -6,12 +6,14 @@
 #include<string>
 #include<vector>
 #include<stdint.h>
+#include<time.h>
 
 typedef uint64_t HIT_INT_TYPE;
 typedef uint64_t READ_INT_TYPE;
 
 const int STRLEN = 10005 ;
 const double EPSILON = 1e-300;
+const double LOG_ZERO = -1e30; // stands for log(0) in log-domain tables, finite so that sums stay finite under -ffast-math and exp() of them is 0
 
 const int MASK_LEN = 24; // the last MASK_LEN bp of a sequence cannot be aligned if poly(A) tail is added
 
@@ -28,6 +30,15 @@ extern bool verbose; // show detail intermediate outputs
 inline bool isZero(double a) { return a < 1e-8; }
 inline bool isLongZero(double a) { return a < 1e-30; }
 
+inline double safeLog(double a) { return a > 0.0 ? log(a) : LOG_ZERO; }
+
+// Return a monotonic wall clock time in seconds, used for measuring the cost of small work units
+inline double getTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
 inline std::string cleanStr(const std::string& str) {
   int len = str.length();
   int fr, to;